@@ -39,6 +39,7 @@
 
 #include "RtMidi.h"
 #include <sstream>
+#include <cstring>
 
 //*********************************************************************//
 //  Common RtMidi Definitions
@@ -69,17 +70,72 @@ void RtMidi :: error( RtError::Type type )
 //  Common RtMidiIn Definitions
 //*********************************************************************//
 
+void RtMidiIn::MidiBytes :: grow( unsigned int size )
+{
+  // Sysex only: grow geometrically and keep the buffer for reuse.
+  unsigned int newSize = heapSize_ * 2;
+  if ( newSize < 256 ) newSize = 256;
+  if ( newSize < size ) newSize = size;
+  unsigned char *heap = new unsigned char[newSize];
+  if ( size_ > 0 ) memcpy( heap, data(), size_ );
+  delete [] heap_;
+  heap_ = heap;
+  heapSize_ = newSize;
+}
+
+void RtMidiIn::MidiBytes :: assign( const unsigned char *first, const unsigned char *last )
+{
+  unsigned int size = last - first;
+  if ( size > INLINE_SIZE ) {
+    if ( size > heapSize_ ) {
+      size_ = 0;
+      grow( size );
+    }
+    memcpy( heap_, first, size );
+  }
+  else if ( size > 0 )
+    memcpy( inline_, first, size );
+  size_ = size;
+}
+
+void RtMidiIn::MidiBytes :: append( const unsigned char *first, const unsigned char *last )
+{
+  unsigned int n = last - first;
+  unsigned int size = size_ + n;
+  if ( size > INLINE_SIZE ) {
+    // Move to (or stay in) the heap buffer.
+    if ( size > heapSize_ ) grow( size );
+    else if ( size_ <= INLINE_SIZE && size_ > 0 ) memcpy( heap_, inline_, size_ );
+    memcpy( heap_ + size_, first, n );
+  }
+  else if ( n > 0 )
+    memcpy( inline_ + size_, first, n );
+  size_ = size;
+}
+
 RtMidiIn :: RtMidiIn( const std::string clientName, unsigned int queueSizeLimit ) : RtMidi()
 {
   this->initialize( clientName );
 
-  // Allocate the MIDI queue.
-  inputData_.queue.ringSize = queueSizeLimit;
-  if ( inputData_.queue.ringSize > 0 )
+  // Allocate the MIDI queue, rounded up to a power of two.
+  inputData_.queue.limit = queueSizeLimit;
+  inputData_.queue.ringSize = 0;
+  if ( queueSizeLimit > 0 ) {
+    inputData_.queue.ringSize = 1;
+    while ( inputData_.queue.ringSize < queueSizeLimit )
+      inputData_.queue.ringSize <<= 1;
     inputData_.queue.ring = new MidiMessage[ inputData_.queue.ringSize ];
+  }
 }
 
-void RtMidiIn :: setCallback( RtMidiCallback callback, void *userData )
+bool RtMidiIn :: hubMode_ = false;
+
+void RtMidiIn :: setHubMode( bool enable )
+{
+  hubMode_ = enable;
+}
+
+void RtMidiIn :: installCallback( void *callback, CallbackType type, void *userData )
 {
   if ( inputData_.usingCallback ) {
     errorString_ = "RtMidiIn::setCallback: a callback function is already set!";
@@ -93,11 +149,69 @@ void RtMidiIn :: setCallback( RtMidiCallback callback, void *userData )
     return;
   }
 
-  inputData_.userCallback = (void *) callback;
+  // Size the scratch buffers up front so that the input thread does
+  // not have to grow them for ordinary traffic.
+  if ( type == VECTOR_CALLBACK )
+    inputData_.callbackBytes.reserve( MidiBytes::INLINE_SIZE );
+  else if ( type == BATCH_CALLBACK ) {
+    inputData_.batch.reserve( 64 );
+    inputData_.batchBytes.reserve( 64 * MidiBytes::INLINE_SIZE );
+  }
+
+  inputData_.userCallback = callback;
   inputData_.userData = userData;
+  inputData_.callbackType = type;
   inputData_.usingCallback = true;
 }
 
+void RtMidiIn :: setCallback( RtMidiCallback callback, void *userData )
+{
+  installCallback( (void *) callback, VECTOR_CALLBACK, userData );
+}
+
+void RtMidiIn :: setCallback( RtMidiRawCallback callback, void *userData )
+{
+  installCallback( (void *) callback, RAW_CALLBACK, userData );
+}
+
+void RtMidiIn :: setBatchCallback( RtMidiBatchCallback callback, void *userData )
+{
+  installCallback( (void *) callback, BATCH_CALLBACK, userData );
+}
+
+void RtMidiIn :: setEventCallback( RtMidiEventCallback callback, void *userData )
+{
+  if ( inputData_.usingEventCallback ) {
+    errorString_ = "RtMidiIn::setEventCallback: an event callback function is already set!";
+    error( RtError::WARNING );
+    return;
+  }
+
+  if ( !callback ) {
+    errorString_ = "RtMidiIn::setEventCallback: callback function value is invalid!";
+    error( RtError::WARNING );
+    return;
+  }
+
+  inputData_.events.reserve( 64 );
+  inputData_.eventCallback = (void *) callback;
+  inputData_.eventUserData = userData;
+  inputData_.usingEventCallback = true;
+}
+
+void RtMidiIn :: cancelEventCallback()
+{
+  if ( !inputData_.usingEventCallback ) {
+    errorString_ = "RtMidiIn::cancelEventCallback: no event callback function was set!";
+    error( RtError::WARNING );
+    return;
+  }
+
+  inputData_.eventCallback = 0;
+  inputData_.eventUserData = 0;
+  inputData_.usingEventCallback = false;
+}
+
 void RtMidiIn :: cancelCallback()
 {
   if ( !inputData_.usingCallback ) {
@@ -129,29 +243,330 @@ double RtMidiIn :: getMessage( std::vector<unsigned char> *message )
     return 0.0;
   }
 
-  if ( inputData_.queue.size == 0 ) return 0.0;
-
   // Copy queued message to the vector pointer argument and then "pop" it.
-  std::vector<unsigned char> *bytes = &(inputData_.queue.ring[inputData_.queue.front].bytes);
-  message->assign( bytes->begin(), bytes->end() );
-  double deltaTime = inputData_.queue.ring[inputData_.queue.front].timeStamp;
-  inputData_.queue.size--;
-  inputData_.queue.front++;
-  if ( inputData_.queue.front == inputData_.queue.ringSize )
-    inputData_.queue.front = 0;
-
+  double deltaTime = 0.0;
+  inputData_.queue.pop( message, &deltaTime );
   return deltaTime;
 }
 
+unsigned int RtMidiIn :: getMessages( MidiMessage *messages, unsigned int maxMessages )
+{
+  if ( inputData_.usingCallback ) {
+    errorString_ = "RtMidiIn::getMessages: a user callback is currently set for this port.";
+    error( RtError::WARNING );
+    return 0;
+  }
+
+  return inputData_.queue.pop( messages, maxMessages );
+}
+
+void RtMidiIn :: setQueueOverflowPolicy( QueueOverflowPolicy policy )
+{
+  if ( policy == QUEUE_COALESCE && !inputData_.queue.pending ) {
+    inputData_.queue.pending = new MidiQueue::PendingMessage[MidiQueue::COALESCE_KEYS]();
+    inputData_.queue.pendingOrder = new unsigned short[MidiQueue::COALESCE_KEYS];
+  }
+  inputData_.queue.policy = policy;
+}
+
+RtMidiIn::InputStats RtMidiIn :: getInputStats() const
+{
+  InputStats stats;
+  stats.queueOverruns = inputData_.queue.overruns.load( std::memory_order_relaxed );
+  stats.coalesced = inputData_.queue.coalesced.load( std::memory_order_relaxed );
+  stats.bufferOverruns = inputData_.bufferOverruns.load( std::memory_order_relaxed );
+  stats.decodeErrors = inputData_.decodeErrors.load( std::memory_order_relaxed );
+  return stats;
+}
+
+bool RtMidiIn::MidiQueue :: write( const unsigned char *bytes, unsigned int size, double timeStamp, double time )
+{
+  if ( limit == 0 ) return false;
+
+  // Only this (producer) thread writes back.
+  unsigned int b = back.load( std::memory_order_relaxed );
+  unsigned int f = front.load( std::memory_order_acquire );
+  while ( b - f >= limit ) {
+    if ( policy != QUEUE_DROP_OLDEST ) return false;
+    // Discard the oldest message.  The consumer claims messages with
+    // the same compare-exchange, so only one of us gets each slot.
+    if ( front.compare_exchange_weak( f, f + 1, std::memory_order_acquire ) ) {
+      overruns.fetch_add( 1, std::memory_order_relaxed );
+      ++f;
+    }
+  }
+
+  // Never overwrite a slot that the consumer may still be copying.
+  unsigned int r = reading.load( std::memory_order_acquire );
+  if ( r != NOT_READING && b - r >= ringSize ) return false;
+
+  MidiMessage& slot = ring[b & (ringSize - 1)];
+  slot.bytes.assign( bytes, bytes + size );
+  slot.timeStamp = timeStamp;
+  slot.time = time;
+  back.store( b + 1, std::memory_order_release );
+  return true;
+}
+
+// Map a continuous controller message to its pending slot, or -1.
+static int coalesceKey( const unsigned char *bytes, unsigned int size )
+{
+  int channel = ( bytes[0] & 0x0F ) * 258;
+  switch ( bytes[0] & 0xF0 ) {
+  case 0xB0: return size == 3 ? channel + bytes[1] : -1;
+  case 0xA0: return size == 3 ? channel + 128 + bytes[1] : -1;
+  case 0xE0: return size == 3 ? channel + 256 : -1;
+  case 0xD0: return size == 2 ? channel + 257 : -1;
+  default: return -1;
+  }
+}
+
+bool RtMidiIn::MidiQueue :: coalesce( const MidiMessage& message )
+{
+  int key = coalesceKey( message.bytes.data(), message.bytes.size() );
+  if ( key < 0 || !pending ) {
+    overruns.fetch_add( 1, std::memory_order_relaxed );
+    return false;
+  }
+
+  // The latest value wins; the stream keeps its place in the order.
+  PendingMessage& slot = pending[key];
+  if ( slot.size ) coalesced.fetch_add( 1, std::memory_order_relaxed );
+  else pendingOrder[nPending++] = (unsigned short) key;
+  slot.size = message.bytes.size();
+  memcpy( slot.bytes, message.bytes.data(), slot.size );
+  slot.timeStamp = message.timeStamp;
+  slot.time = message.time;
+  return true;
+}
+
+bool RtMidiIn::MidiQueue :: flushPending()
+{
+  unsigned int i = 0;
+  while ( i < nPending ) {
+    PendingMessage& slot = pending[pendingOrder[i]];
+    if ( !write( slot.bytes, slot.size, slot.timeStamp, slot.time ) ) break;
+    slot.size = 0;
+    ++i;
+  }
+
+  if ( i > 0 ) {
+    nPending -= i;
+    memmove( pendingOrder, pendingOrder + i, nPending * sizeof( unsigned short ) );
+  }
+  return nPending == 0;
+}
+
+bool RtMidiIn::MidiQueue :: push( const MidiMessage& message )
+{
+  // Held-back controller values go out first so that they stay ahead
+  // of newer messages.
+  if ( nPending == 0 || flushPending() ) {
+    if ( write( message.bytes.data(), message.bytes.size(), message.timeStamp, message.time ) ) return true;
+  }
+
+  if ( policy == QUEUE_COALESCE ) return coalesce( message );
+  overruns.fetch_add( 1, std::memory_order_relaxed );
+  return false;
+}
+
+unsigned int RtMidiIn::MidiQueue :: claim( unsigned int maxMessages, unsigned int *first )
+{
+  unsigned int f = front.load( std::memory_order_acquire );
+  unsigned int count;
+  do {
+    count = back.load( std::memory_order_acquire ) - f;
+    if ( count > maxMessages ) count = maxMessages;
+    if ( count == 0 ) {
+      reading.store( NOT_READING, std::memory_order_release );
+      return 0;
+    }
+    // Announce the slots before claiming them, so that a producer that
+    // sees them claimed also sees that they are being read.
+    reading.store( f, std::memory_order_relaxed );
+  } while ( !front.compare_exchange_weak( f, f + count, std::memory_order_acq_rel,
+                                         std::memory_order_acquire ) );
+
+  *first = f;
+  return count;
+}
+
+unsigned int RtMidiIn::MidiQueue :: pop( MidiMessage *messages, unsigned int maxMessages )
+{
+  unsigned int f;
+  unsigned int count = claim( maxMessages, &f );
+  if ( count == 0 ) return 0;
+
+  for ( unsigned int i=0; i<count; ++i )
+    messages[i] = ring[(f + i) & (ringSize - 1)];
+
+  // Hand the slots back to the producer in one go.
+  reading.store( NOT_READING, std::memory_order_release );
+  return count;
+}
+
+bool RtMidiIn::MidiQueue :: pop( std::vector<unsigned char> *bytes, double *timeStamp )
+{
+  unsigned int f;
+  if ( claim( 1, &f ) == 0 ) return false;
+
+  const MidiMessage& message = ring[f & (ringSize - 1)];
+  bytes->assign( message.bytes.begin(), message.bytes.end() );
+  *timeStamp = message.timeStamp;
+  reading.store( NOT_READING, std::memory_order_release );
+  return true;
+}
+
+// Decode the channel-voice message at the start of bytes.  Returns
+// the number of bytes used, or 0 if there is no complete message.
+static unsigned int parseChannelMessage( const unsigned char *bytes, unsigned int size,
+                                         RtMidiIn::MidiEvent *event )
+{
+  const MidiStatusInfo& info = midiStatusTable[bytes[0]];
+  if ( info.kind > MIDI_PITCH_WHEEL || size < info.length ) return 0;
+
+  event->type = bytes[0] & 0xF0;
+  event->channel = info.channel;
+  event->data1 = bytes[1];
+  event->data2 = info.length == 3 ? bytes[2] : 0;
+  event->value14 = event->data1 | ( event->data2 << 7 );
+  return info.length;
+}
+
+// Hand a complete incoming message to the user: invoke the callback,
+// append it to the pending batch or push it onto the queue.  This is
+// called from the API-specific input handlers.
+void deliverMidiMessage( RtMidiIn::RtMidiInData *data, RtMidiIn::MidiMessage& message )
+{
+  if ( data->usingEventCallback ) {
+    // Channel-voice bytes from the APIs without a direct path become
+    // typed events.  One message can hold several (e.g. an ALSA
+    // 14-bit controller event decodes to two controller messages).
+    RtMidiIn::MidiEvent event;
+    event.timeStamp = message.timeStamp;
+    event.time = message.time;
+    const unsigned char *bytes = message.bytes.data();
+    unsigned int size = message.bytes.size(), length;
+    bool parsed = false;
+    while ( size > 0 && ( length = parseChannelMessage( bytes, size, &event ) ) > 0 ) {
+      data->events.push_back( event );
+      bytes += length;
+      size -= length;
+      parsed = true;
+    }
+    if ( parsed ) return;
+  }
+
+  if ( data->usingCallback ) {
+    if ( data->callbackType == RtMidiIn::RAW_CALLBACK ) {
+      RtMidiIn::RtMidiRawCallback callback = (RtMidiIn::RtMidiRawCallback) data->userCallback;
+      callback( message.timeStamp, message.bytes.data(), message.bytes.size(), data->userData );
+    }
+    else if ( data->callbackType == RtMidiIn::BATCH_CALLBACK ) {
+      // Record the offset of the bytes for now, since the byte buffer
+      // may grow before the batch is flushed.
+      RtMidiIn::MidiRecord record;
+      record.timeStamp = message.timeStamp;
+      record.bytes = (const unsigned char *) data->batchBytes.size();
+      record.size = message.bytes.size();
+      data->batch.push_back( record );
+      data->batchBytes.insert( data->batchBytes.end(), message.bytes.begin(), message.bytes.end() );
+    }
+    else {
+      // The vector keeps its capacity between messages, so this only
+      // allocates when a message is longer than any seen before.
+      data->callbackBytes.assign( message.bytes.begin(), message.bytes.end() );
+      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
+      callback( message.timeStamp, &data->callbackBytes, data->userData );
+    }
+  }
+  else {
+    // Push the message; a full queue is handled according to the
+    // overflow policy and counted rather than reported from here.
+    data->queue.push( message );
+  }
+}
+
+// Invoke the event and batch callbacks with everything delivered
+// since the last flush.  The input handlers call this once per wakeup.
+void flushMidiBatch( RtMidiIn::RtMidiInData *data )
+{
+  if ( data->usingEventCallback && !data->events.empty() ) {
+    RtMidiIn::RtMidiEventCallback callback = (RtMidiIn::RtMidiEventCallback) data->eventCallback;
+    callback( &data->events[0], data->events.size(), data->eventUserData );
+    data->events.clear();
+  }
+
+  if ( !data->usingCallback || data->callbackType != RtMidiIn::BATCH_CALLBACK ||
+       data->batch.empty() ) return;
+
+  const unsigned char *bytes = &data->batchBytes[0];
+  for ( unsigned int i=0; i<data->batch.size(); ++i )
+    data->batch[i].bytes = bytes + (size_t) data->batch[i].bytes;
+
+  RtMidiIn::RtMidiBatchCallback callback = (RtMidiIn::RtMidiBatchCallback) data->userCallback;
+  callback( &data->batch[0], data->batch.size(), data->userData );
+
+  data->batch.clear();
+  data->batchBytes.clear();
+}
+
 //*********************************************************************//
 //  Common RtMidiOut Definitions
 //*********************************************************************//
 
-RtMidiOut :: RtMidiOut( const std::string clientName ) : RtMidi()
+RtMidiOut :: RtMidiOut( const std::string clientName ) : RtMidi(), deferFlush_( false )
 {
+  flushCount_.events = 0;
+  flushCount_.bytes = 0;
   this->initialize( clientName );
 }
 
+void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
+{
+  sendMessage( message->empty() ? 0 : &(*message)[0], message->size() );
+}
+
+void RtMidiOut :: sendMessages( const unsigned char *messages, size_t size )
+{
+  bool deferred = deferFlush_;
+  deferFlush_ = true;
+  while ( size > 0 ) {
+    size_t length;
+    if ( messages[0] == 0xF0 ) {
+      const unsigned char *end = (const unsigned char *) memchr( messages, 0xF7, size );
+      length = end ? end - messages + 1 : 0;
+    }
+    else
+      length = midiStatusTable[messages[0]].length;
+    if ( length == 0 || length > size ) {
+      errorString_ = "RtMidiOut::sendMessages: incomplete message or missing status byte!";
+      error( RtError::WARNING );
+      break;
+    }
+    sendMessage( messages, length );
+    messages += length;
+    size -= length;
+  }
+  deferFlush_ = deferred;
+  if ( !deferred ) drainOutput();
+}
+
+void RtMidiOut :: setDeferredFlush( bool deferred )
+{
+  deferFlush_ = deferred;
+  if ( !deferred ) drainOutput();
+}
+
+RtMidiOut::FlushCount RtMidiOut :: flush()
+{
+  if ( flushCount_.events > 0 ) drainOutput();
+  FlushCount count = flushCount_;
+  flushCount_.events = 0;
+  flushCount_.bytes = 0;
+  return count;
+}
+
 
 //*********************************************************************//
 //  API: Macintosh OS-X
@@ -245,21 +660,8 @@ void midiInputCallback( const MIDIPacketList *list, void *procRef, void *srcRef
 
       if ( !continueSysex ) {
         // If not a continuing sysex message, invoke the user callback function or queue the message.
-        if ( data->usingCallback && message.bytes.size() > 0 ) {
-          RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-          callback( message.timeStamp, &message.bytes, data->userData );
-        }
-        else {
-          // As long as we haven't reached our queue size limit, push the message.
-          if ( data->queue.size < data->queue.ringSize ) {
-            data->queue.ring[data->queue.back++] = message;
-            if ( data->queue.back == data->queue.ringSize )
-              data->queue.back = 0;
-            data->queue.size++;
-          }
-          else
-            std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
-        }
+        if ( message.bytes.size() > 0 )
+          deliverMidiMessage( data, message );
         message.bytes.clear();
       }
     }
@@ -309,21 +711,7 @@ void midiInputCallback( const MIDIPacketList *list, void *procRef, void *srcRef
           message.bytes.assign( &packet->data[iByte], &packet->data[iByte+size] );
           if ( !continueSysex ) {
             // If not a continuing sysex message, invoke the user callback function or queue the message.
-            if ( data->usingCallback ) {
-              RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-              callback( message.timeStamp, &message.bytes, data->userData );
-            }
-            else {
-              // As long as we haven't reached our queue size limit, push the message.
-              if ( data->queue.size < data->queue.ringSize ) {
-                data->queue.ring[data->queue.back++] = message;
-                if ( data->queue.back == data->queue.ringSize )
-                  data->queue.back = 0;
-                data->queue.size++;
-              }
-              else
-                std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
-            }
+            deliverMidiMessage( data, message );
             message.bytes.clear();
           }
           iByte += size;
@@ -332,6 +720,9 @@ void midiInputCallback( const MIDIPacketList *list, void *procRef, void *srcRef
     }
     packet = MIDIPacketNext(packet);
   }
+
+  // Hand the whole packet list to a batch callback in one go.
+  flushMidiBatch( data );
 }
 
 void RtMidiIn :: initialize( const std::string& clientName )
@@ -445,9 +836,11 @@ RtMidiIn :: ~RtMidiIn()
   MIDIClientDispose( data->client );
   if ( data->endpoint ) MIDIEndpointDispose( data->endpoint );
   delete data;
+}
 
-  // Delete the MIDI queue.
-  if ( inputData_.queue.ringSize > 0 ) delete [] inputData_.queue.ring;
+double RtMidiIn :: getTime()
+{
+  return 0.0;
 }
 
 unsigned int RtMidiIn :: getPortCount()
@@ -755,11 +1148,11 @@ void sysexCompletionProc( MIDISysexSendRequest * sreq )
  sysexBuffer = 0;
 }
 
-void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
+void RtMidiOut :: sendMessage( const unsigned char *message, size_t size )
 {
   // We use the MIDISendSysex() function to asynchronously send sysex
   // messages.  Otherwise, we use a single CoreMidi MIDIPacket.
-  unsigned int nBytes = message->size();
+  unsigned int nBytes = size;
   if ( nBytes == 0 ) {
     errorString_ = "RtMidiOut::sendMessage: no data in message argument!";      
     error( RtError::WARNING );
@@ -772,7 +1165,7 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
   CoreMidiData *data = static_cast<CoreMidiData *> (apiData_);
   OSStatus result;
 
-  if ( message->at(0) == 0xF0 ) {
+  if ( message[0] == 0xF0 ) {
 
     while ( sysexBuffer != 0 ) usleep( 1000 ); // sleep 1 ms
 
@@ -783,7 +1176,7 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
    }
 
    // Copy data to buffer.
-   for ( unsigned int i=0; i<nBytes; ++i ) sysexBuffer[i] = message->at(i);
+   for ( unsigned int i=0; i<nBytes; ++i ) sysexBuffer[i] = message[i];
 
    data->sysexreq.destination = data->destinationId;
    data->sysexreq.data = (Byte *)sysexBuffer;
@@ -797,6 +1190,8 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
      errorString_ = "RtMidiOut::sendMessage: error sending MIDI to virtual destinations.";
      error( RtError::WARNING );
    }
+   flushCount_.events++;
+   flushCount_.bytes += nBytes;
    return;
   }
   else if ( nBytes > 3 ) {
@@ -807,7 +1202,7 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
 
   MIDIPacketList packetList;
   MIDIPacket *packet = MIDIPacketListInit( &packetList );
-  packet = MIDIPacketListAdd( &packetList, sizeof(packetList), packet, timeStamp, nBytes, (const Byte *) &message->at( 0 ) );
+  packet = MIDIPacketListAdd( &packetList, sizeof(packetList), packet, timeStamp, nBytes, (const Byte *) message );
   if ( !packet ) {
     errorString_ = "RtMidiOut::sendMessage: could not allocate packet list";      
     error( RtError::DRIVER_ERROR );
@@ -830,7 +1225,23 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
       error( RtError::WARNING );
     }
   }
+  flushCount_.events++;
+  flushCount_.bytes += nBytes;
+}
+
+void RtMidiOut :: drainOutput()
+{
+  // Messages are sent immediately, so there is nothing to flush.
+}
 
+void RtMidiOut :: sendMessageAt( const unsigned char *message, size_t size, double /*time*/ )
+{
+  sendMessage( message, size );
+}
+
+double RtMidiOut :: getTime()
+{
+  return 0.0;
 }
 
 #endif  // __MACOSX_CORE__
@@ -857,12 +1268,17 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // ALSA header file.
 #include <alsa/asoundlib.h>
 
 // A structure to hold variables related to the ALSA API
 // implementation.
+struct AlsaMidiHub;
+
 struct AlsaMidiData {
   snd_seq_t *seq;
   int vport;
@@ -873,190 +1289,557 @@ struct AlsaMidiData {
   pthread_t thread;
   unsigned long long lastTime;
   int queue_id; // an input queue is needed to get timestamped events
+  int trigger_fds[2]; // written to wake the input thread for shutdown
+  AlsaMidiHub *hub; // the shared client in hub mode, else 0
 };
 
 #define PORT_TYPE( pinfo, bits ) ((snd_seq_port_info_get_capability(pinfo) & (bits)) == (bits))
 
+// In hub mode all RtMidiIn instances share one sequencer client, one
+// queue and one input thread.  Ports opened with openPort() are all
+// subscribed to a single hub port, and each instance registers a
+// route for its source address.  A virtual port is a hub port of its
+// own and is routed by destination instead.
+struct AlsaMidiRoute {
+  snd_seq_addr_t source; // the subscribed sender (vport < 0 only)
+  int vport;             // the virtual port, or -1
+  RtMidiIn::RtMidiInData *data;
+};
+
+struct AlsaMidiHub {
+  snd_seq_t *seq;
+  int vport; // the destination of all openPort() subscriptions
+  int queue_id;
+  pthread_t thread;
+  int trigger_fds[2];
+  bool doInput;
+  pthread_mutex_t mutex; // guards routes; held by the thread while it delivers
+  std::vector<AlsaMidiRoute> routes;
+  unsigned int nClients;
+};
+
+static AlsaMidiHub *alsaHub = 0;
+static pthread_mutex_t alsaHubMutex = PTHREAD_MUTEX_INITIALIZER; // guards alsaHub
+
 //*********************************************************************//
 //  API: LINUX ALSA
 //  Class Definitions: RtMidiIn
 //*********************************************************************//
 
+// Create a timestamping input port on the given client.
+static int alsaCreateInputPort( snd_seq_t *seq, int queue_id, const std::string& portName )
+{
+  snd_seq_port_info_t *pinfo;
+  snd_seq_port_info_alloca( &pinfo );
+  snd_seq_port_info_set_capability( pinfo,
+                                    SND_SEQ_PORT_CAP_WRITE |
+                                    SND_SEQ_PORT_CAP_SUBS_WRITE );
+  snd_seq_port_info_set_type( pinfo,
+                              SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+                              SND_SEQ_PORT_TYPE_APPLICATION );
+  snd_seq_port_info_set_midi_channels(pinfo, 16);
+#ifndef AVOID_TIMESTAMPING
+  snd_seq_port_info_set_timestamping(pinfo, 1);
+  snd_seq_port_info_set_timestamp_real(pinfo, 1);
+  snd_seq_port_info_set_timestamp_queue(pinfo, queue_id);
+#endif
+  snd_seq_port_info_set_name(pinfo, portName.c_str());
+  return snd_seq_create_port(seq, pinfo);
+}
+
+// Compute the delta time of an incoming event.
+static double alsaDeltaTime( RtMidiIn::RtMidiInData *data, AlsaMidiData *apiData,
+                             const snd_seq_event_t *ev )
+{
+  // Method 1: Use the system time.
+  //(void)gettimeofday(&tv, (struct timezone *)NULL);
+  //time = (tv.tv_sec * 1000000) + tv.tv_usec;
+
+  // Method 2: Use the ALSA sequencer event time data.
+  // (thanks to Pedro Lopez-Cabanillas!).
+  unsigned long long time = ( ev->time.time.tv_sec * 1000000ULL ) + ( ev->time.time.tv_nsec/1000 );
+  unsigned long long lastTime = apiData->lastTime;
+  apiData->lastTime = time;
+  if ( data->firstMessage == true ) {
+    data->firstMessage = false;
+    return 0.0;
+  }
+  return ( time - lastTime ) * 0.000001;
+}
+
+// The absolute real time the sequencer stamped on an event.
+static inline double alsaEventTime( const snd_seq_event_t *ev )
+{
+  return ev->time.time.tv_sec + ev->time.time.tv_nsec * 0.000000001;
+}
+
+// Fill a typed event straight from the fields of a channel-voice
+// sequencer event.  Returns false for all other event types.
+static bool alsaChannelEvent( const snd_seq_event_t *ev, RtMidiIn::MidiEvent *event )
+{
+  switch ( ev->type ) {
+  case SND_SEQ_EVENT_NOTEON:
+  case SND_SEQ_EVENT_NOTEOFF:
+  case SND_SEQ_EVENT_KEYPRESS:
+    event->type = ev->type == SND_SEQ_EVENT_NOTEON ? 0x90 :
+      ev->type == SND_SEQ_EVENT_NOTEOFF ? 0x80 : 0xA0;
+    event->channel = ev->data.note.channel & 0x0F;
+    event->data1 = ev->data.note.note & 0x7F;
+    event->data2 = ev->data.note.velocity & 0x7F;
+    break;
+  case SND_SEQ_EVENT_CONTROLLER:
+    if ( ev->data.control.param > 127 ) return false;
+    event->type = 0xB0;
+    event->channel = ev->data.control.channel & 0x0F;
+    event->data1 = ev->data.control.param;
+    event->data2 = ev->data.control.value & 0x7F;
+    break;
+  case SND_SEQ_EVENT_PGMCHANGE:
+  case SND_SEQ_EVENT_CHANPRESS:
+    event->type = ev->type == SND_SEQ_EVENT_PGMCHANGE ? 0xC0 : 0xD0;
+    event->channel = ev->data.control.channel & 0x0F;
+    event->data1 = ev->data.control.value & 0x7F;
+    event->data2 = 0;
+    break;
+  case SND_SEQ_EVENT_PITCHBEND:
+  {
+    // ALSA carries the wheel as a signed value centred on zero.
+    int value = ev->data.control.value + 8192;
+    if ( value < 0 ) value = 0;
+    if ( value > 16383 ) value = 16383;
+    event->type = 0xE0;
+    event->channel = ev->data.control.channel & 0x0F;
+    event->data1 = value & 0x7F;
+    event->data2 = value >> 7;
+    break;
+  }
+  default:
+    return false;
+  }
+  event->value14 = event->data1 | ( event->data2 << 7 );
+  return true;
+}
+
+// Deliver one sequencer event to an input.  The decoder, sysex
+// buffer and partial message are per input, so that in hub mode a
+// segmented sysex from one port cannot be mixed with another port.
+static void alsaProcessEvent( RtMidiIn::RtMidiInData *data, AlsaMidiData *apiData,
+                              const snd_seq_event_t *ev )
+{
+  // With an event callback, channel-voice events are read directly
+  // from the sequencer event instead of being decoded to bytes.
+  RtMidiIn::MidiEvent event;
+  if ( data->usingEventCallback && alsaChannelEvent( ev, &event ) ) {
+    event.timeStamp = alsaDeltaTime( data, apiData, ev );
+    event.time = alsaEventTime( ev );
+    data->events.push_back( event );
+    return;
+  }
+
+  // This is a bit weird, but we now have to decode an ALSA MIDI
+  // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
+  RtMidiIn::MidiMessage& message = data->message;
+  if ( !data->continueSysex ) message.bytes.clear();
+
+  bool doDecode = false;
+  switch ( ev->type ) {
+
+  case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+#if defined(__RTMIDI_DEBUG__)
+    std::cout << "RtMidiIn::alsaMidiHandler: port connection made!\n";
+#endif
+    break;
+
+  case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+#if defined(__RTMIDI_DEBUG__)
+    std::cerr << "RtMidiIn::alsaMidiHandler: port connection has closed!\n";
+    std::cout << "sender = " << (int) ev->data.connect.sender.client << ":"
+              << (int) ev->data.connect.sender.port
+              << ", dest = " << (int) ev->data.connect.dest.client << ":"
+              << (int) ev->data.connect.dest.port
+              << std::endl;
+#endif
+    break;
+
+  case SND_SEQ_EVENT_QFRAME: // MIDI time code
+    if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_TICK: // MIDI timing tick
+    if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_SENSING: // Active sensing
+    if ( !( data->ignoreFlags & 0x04 ) ) doDecode = true;
+    break;
+
+  case SND_SEQ_EVENT_SYSEX:
+    if ( (data->ignoreFlags & 0x01) ) break;
+    if ( ev->data.ext.len > apiData->bufferSize ) {
+      apiData->bufferSize = ev->data.ext.len;
+      free( apiData->buffer );
+      apiData->buffer = (unsigned char *) malloc( apiData->bufferSize );
+      if ( apiData->buffer == NULL ) {
+        apiData->bufferSize = 0;
+        data->doInput = false;
+        std::cerr << "\nRtMidiIn::alsaMidiHandler: error resizing buffer memory!\n\n";
+        break;
+      }
+    }
+
+  default:
+    doDecode = true;
+  }
+
+  if ( doDecode && data->doInput ) {
+
+    unsigned char *buffer = apiData->buffer;
+    long nBytes = snd_midi_event_decode( apiData->coder, buffer, apiData->bufferSize, ev );
+    if ( nBytes < 0 )
+      data->decodeErrors.fetch_add( 1, std::memory_order_relaxed );
+    else if ( nBytes > 0 ) {
+      // The ALSA sequencer has a maximum buffer size for MIDI sysex
+      // events of 256 bytes.  If a device sends sysex messages larger
+      // than this, they are segmented into 256 byte chunks.  So,
+      // we'll watch for this and concatenate sysex chunks into a
+      // single sysex message if necessary.
+      if ( !data->continueSysex )
+        message.bytes.assign( buffer, &buffer[nBytes] );
+      else
+        message.bytes.append( buffer, &buffer[nBytes] );
+
+      data->continueSysex = ( ( ev->type == SND_SEQ_EVENT_SYSEX ) && ( message.bytes.back() != 0xF7 ) );
+      if ( !data->continueSysex ) {
+        // Calculate the time stamp:
+        message.timeStamp = alsaDeltaTime( data, apiData, ev );
+        message.time = alsaEventTime( ev );
+      }
+      else {
+#if defined(__RTMIDI_DEBUG__)
+        std::cerr << "\nRtMidiIn::alsaMidiHandler: event parsing error or not a MIDI event!\n\n";
+#endif
+      }
+    }
+  }
+
+  if ( message.bytes.size() == 0 || data->continueSysex ) return;
+
+  deliverMidiMessage( data, message );
+}
+
 extern "C" void *alsaMidiHandler( void *ptr )
 {
   RtMidiIn::RtMidiInData *data = static_cast<RtMidiIn::RtMidiInData *> (ptr);
   AlsaMidiData *apiData = static_cast<AlsaMidiData *> (data->apiData);
 
-  long nBytes;
-  unsigned long long time, lastTime;
-  bool continueSysex = false;
-  bool doDecode = false;
-  RtMidiIn::MidiMessage message;
-
   snd_seq_event_t *ev;
   int result;
-  apiData->bufferSize = 32;
-  result = snd_midi_event_new( 0, &apiData->coder );
-  if ( result < 0 ) {
-    data->doInput = false;
-    std::cerr << "\nRtMidiIn::alsaMidiHandler: error initializing MIDI event parser!\n\n";
-    return 0;
-  }
-  unsigned char *buffer = (unsigned char *) malloc( apiData->bufferSize );
-  if ( buffer == NULL ) {
+
+  // Poll on the sequencer descriptors plus the read end of the
+  // trigger pipe, so that the thread sleeps until there is input or
+  // the port is being shut down.
+  int nPollFds = snd_seq_poll_descriptors_count( apiData->seq, POLLIN ) + 1;
+  struct pollfd *pollFds = (struct pollfd *) malloc( nPollFds * sizeof( struct pollfd ) );
+  if ( pollFds == NULL ) {
     data->doInput = false;
-    std::cerr << "\nRtMidiIn::alsaMidiHandler: error initializing buffer memory!\n\n";
+    std::cerr << "\nRtMidiIn::alsaMidiHandler: error initializing poll descriptors!\n\n";
     return 0;
   }
-  snd_midi_event_init( apiData->coder );
-  snd_midi_event_no_status( apiData->coder, 1 ); // suppress running status messages
+  pollFds[0].fd = apiData->trigger_fds[0];
+  pollFds[0].events = POLLIN;
+  snd_seq_poll_descriptors( apiData->seq, pollFds + 1, nPollFds - 1, POLLIN );
 
   while ( data->doInput ) {
 
     if ( snd_seq_event_input_pending( apiData->seq, 1 ) == 0 ) {
-      // No data pending ... sleep a bit.
-      usleep( 1000 );
+      // Everything that was ready has been drained, so hand it to a
+      // batch callback before going back to sleep.
+      flushMidiBatch( data );
+
+      // No data pending ... block until the sequencer or the trigger
+      // pipe becomes readable.  If coalesced controller values are
+      // waiting for room in the queue, wake up again shortly to retry.
+      int timeout = data->queue.nPending > 0 ? 1 : -1;
+      if ( poll( pollFds, nPollFds, timeout ) < 0 && errno != EINTR ) {
+        std::cerr << "\nRtMidiIn::alsaMidiHandler: error polling for MIDI input!\n\n";
+        break;
+      }
+      if ( pollFds[0].revents & POLLIN ) {
+        char dummy;
+        while ( read( pollFds[0].fd, &dummy, sizeof( dummy ) ) > 0 ) {}
+      }
+      if ( data->queue.nPending > 0 ) data->queue.flushPending();
       continue;
     }
 
-    // If here, there should be data.
+    // If here, there should be data.  Problems are counted rather than
+    // printed, since writing to a terminal from this thread during an
+    // overload only makes matters worse.
     result = snd_seq_event_input( apiData->seq, &ev );
     if ( result == -ENOSPC ) {
-      std::cerr << "\nRtMidiIn::alsaMidiHandler: MIDI input buffer overrun!\n\n";
+      data->bufferOverruns.fetch_add( 1, std::memory_order_relaxed );
       continue;
     }
     else if ( result <= 0 ) {
-      std::cerr << "RtMidiIn::alsaMidiHandler: unknown MIDI input error!\n";
+      data->decodeErrors.fetch_add( 1, std::memory_order_relaxed );
       continue;
     }
 
-    // This is a bit weird, but we now have to decode an ALSA MIDI
-    // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
-    if ( !continueSysex ) message.bytes.clear();
-
-    doDecode = false;
-    switch ( ev->type ) {
+    alsaProcessEvent( data, apiData, ev );
+    snd_seq_free_event( ev );
+  }
 
-		case SND_SEQ_EVENT_PORT_SUBSCRIBED:
-#if defined(__RTMIDI_DEBUG__)
-      std::cout << "RtMidiIn::alsaMidiHandler: port connection made!\n";
-#endif
-      break;
+  free( pollFds );
+  return 0;
+}
 
-		case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
-#if defined(__RTMIDI_DEBUG__)
-      std::cerr << "RtMidiIn::alsaMidiHandler: port connection has closed!\n";
-      std::cout << "sender = " << (int) ev->data.connect.sender.client << ":"
-                << (int) ev->data.connect.sender.port
-                << ", dest = " << (int) ev->data.connect.dest.client << ":"
-                << (int) ev->data.connect.dest.port
-                << std::endl;
-#endif
-      break;
+// Does an event belong to the given route?
+static inline bool alsaRouteMatches( const AlsaMidiHub *hub, const AlsaMidiRoute& route,
+                                     const snd_seq_event_t *ev )
+{
+  if ( route.vport >= 0 ) return ev->dest.port == route.vport;
+  return ev->dest.port == hub->vport && ev->source.client == route.source.client &&
+    ev->source.port == route.source.port;
+}
 
-    case SND_SEQ_EVENT_QFRAME: // MIDI time code
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
+extern "C" void *alsaMidiHubHandler( void *ptr )
+{
+  AlsaMidiHub *hub = static_cast<AlsaMidiHub *> (ptr);
 
-    case SND_SEQ_EVENT_TICK: // MIDI timing tick
-      if ( !( data->ignoreFlags & 0x02 ) ) doDecode = true;
-      break;
+  snd_seq_event_t *ev;
+  int result;
 
-    case SND_SEQ_EVENT_SENSING: // Active sensing
-      if ( !( data->ignoreFlags & 0x04 ) ) doDecode = true;
-      break;
+  int nPollFds = snd_seq_poll_descriptors_count( hub->seq, POLLIN ) + 1;
+  struct pollfd *pollFds = (struct pollfd *) malloc( nPollFds * sizeof( struct pollfd ) );
+  if ( pollFds == NULL ) {
+    hub->doInput = false;
+    std::cerr << "\nRtMidiIn::alsaMidiHubHandler: error initializing poll descriptors!\n\n";
+    return 0;
+  }
+  pollFds[0].fd = hub->trigger_fds[0];
+  pollFds[0].events = POLLIN;
+  snd_seq_poll_descriptors( hub->seq, pollFds + 1, nPollFds - 1, POLLIN );
+
+  while ( hub->doInput ) {
+
+    // The route table is locked once per wakeup rather than per event.
+    // Holding it while delivering also keeps an instance from being
+    // destroyed under the thread.
+    int timeout = -1;
+    pthread_mutex_lock( &hub->mutex );
+    size_t nRoutes = hub->routes.size();
+    for ( size_t i = 0; i < nRoutes; i++ ) {
+      RtMidiIn::RtMidiInData *data = hub->routes[i].data;
+      if ( data->queue.nPending > 0 ) data->queue.flushPending();
+    }
 
-		case SND_SEQ_EVENT_SYSEX:
-      if ( (data->ignoreFlags & 0x01) ) break;
-      if ( ev->data.ext.len > apiData->bufferSize ) {
-        apiData->bufferSize = ev->data.ext.len;
-        free( buffer );
-        buffer = (unsigned char *) malloc( apiData->bufferSize );
-        if ( buffer == NULL ) {
-          data->doInput = false;
-          std::cerr << "\nRtMidiIn::alsaMidiHandler: error resizing buffer memory!\n\n";
-          break;
-        }
+    while ( snd_seq_event_input_pending( hub->seq, 1 ) > 0 ) {
+      result = snd_seq_event_input( hub->seq, &ev );
+      if ( result == -ENOSPC ) {
+        // The shared buffer overflowed, so any input may have lost data.
+        for ( size_t i = 0; i < nRoutes; i++ )
+          hub->routes[i].data->bufferOverruns.fetch_add( 1, std::memory_order_relaxed );
+        continue;
       }
+      else if ( result <= 0 ) continue;
 
-    default:
-      doDecode = true;
-    }
-
-    if ( doDecode ) {
-
-      nBytes = snd_midi_event_decode( apiData->coder, buffer, apiData->bufferSize, ev );
-      if ( nBytes > 0 ) {
-        // The ALSA sequencer has a maximum buffer size for MIDI sysex
-        // events of 256 bytes.  If a device sends sysex messages larger
-        // than this, they are segmented into 256 byte chunks.  So,
-        // we'll watch for this and concatenate sysex chunks into a
-        // single sysex message if necessary.
-        if ( !continueSysex )
-          message.bytes.assign( buffer, &buffer[nBytes] );
-        else
-          message.bytes.insert( message.bytes.end(), buffer, &buffer[nBytes] );
-
-        continueSysex = ( ( ev->type == SND_SEQ_EVENT_SYSEX ) && ( message.bytes.back() != 0xF7 ) );
-        if ( !continueSysex ) {
-
-          // Calculate the time stamp:
-          message.timeStamp = 0.0;
-
-          // Method 1: Use the system time.
-          //(void)gettimeofday(&tv, (struct timezone *)NULL);
-          //time = (tv.tv_sec * 1000000) + tv.tv_usec;
-
-          // Method 2: Use the ALSA sequencer event time data.
-          // (thanks to Pedro Lopez-Cabanillas!).
-          time = ( ev->time.time.tv_sec * 1000000 ) + ( ev->time.time.tv_nsec/1000 );
-          lastTime = time;
-          time -= apiData->lastTime;
-          apiData->lastTime = lastTime;
-          if ( data->firstMessage == true )
-            data->firstMessage = false;
-          else
-            message.timeStamp = time * 0.000001;
-        }
-        else {
-#if defined(__RTMIDI_DEBUG__)
-          std::cerr << "\nRtMidiIn::alsaMidiHandler: event parsing error or not a MIDI event!\n\n";
-#endif
-        }
+      for ( size_t i = 0; i < nRoutes; i++ ) {
+        const AlsaMidiRoute& route = hub->routes[i];
+        if ( route.data->doInput && alsaRouteMatches( hub, route, ev ) )
+          alsaProcessEvent( route.data, static_cast<AlsaMidiData *> (route.data->apiData), ev );
       }
+      snd_seq_free_event( ev );
     }
 
-    snd_seq_free_event( ev );
-    if ( message.bytes.size() == 0 ) continue;
+    for ( size_t i = 0; i < nRoutes; i++ ) {
+      RtMidiIn::RtMidiInData *data = hub->routes[i].data;
+      flushMidiBatch( data );
+      if ( data->queue.nPending > 0 ) timeout = 1;
+    }
+    pthread_mutex_unlock( &hub->mutex );
 
-    if ( data->usingCallback && !continueSysex ) {
-      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-      callback( message.timeStamp, &message.bytes, data->userData );
+    if ( poll( pollFds, nPollFds, timeout ) < 0 && errno != EINTR ) {
+      std::cerr << "\nRtMidiIn::alsaMidiHubHandler: error polling for MIDI input!\n\n";
+      break;
     }
-    else {
-      // As long as we haven't reached our queue size limit, push the message.
-      if ( data->queue.size < data->queue.ringSize ) {
-        data->queue.ring[data->queue.back++] = message;
-        if ( data->queue.back == data->queue.ringSize )
-          data->queue.back = 0;
-        data->queue.size++;
-      }
-      else
-        std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
+    if ( pollFds[0].revents & POLLIN ) {
+      char dummy;
+      while ( read( pollFds[0].fd, &dummy, sizeof( dummy ) ) > 0 ) {}
     }
   }
 
-  if ( buffer ) free( buffer );
-  snd_midi_event_free( apiData->coder );
-  apiData->coder = 0;
+  free( pollFds );
   return 0;
 }
 
+// Shut down and free a hub.  Also cleans up after a failed start.
+static void alsaHubDestroy( AlsaMidiHub *hub )
+{
+  if ( hub->doInput ) {
+    hub->doInput = false;
+    int res = write( hub->trigger_fds[1], &hub->doInput, sizeof( hub->doInput ) );
+    (void) res;
+    pthread_join( hub->thread, NULL );
+  }
+  if ( hub->trigger_fds[0] >= 0 ) close( hub->trigger_fds[0] );
+  if ( hub->trigger_fds[1] >= 0 ) close( hub->trigger_fds[1] );
+  if ( hub->seq ) {
+    if ( hub->vport >= 0 ) snd_seq_delete_port( hub->seq, hub->vport );
+#ifndef AVOID_TIMESTAMPING
+    if ( hub->queue_id >= 0 ) snd_seq_free_queue( hub->seq, hub->queue_id );
+#endif
+    snd_seq_close( hub->seq );
+  }
+  pthread_mutex_destroy( &hub->mutex );
+  delete hub;
+}
+
+// Return the shared hub, starting it for the first client.  Returns
+// 0 if the sequencer client, queue, port or thread can't be set up.
+static AlsaMidiHub *alsaHubAcquire( const std::string& clientName )
+{
+  pthread_mutex_lock( &alsaHubMutex );
+  if ( alsaHub == 0 ) {
+    AlsaMidiHub *hub = new AlsaMidiHub;
+    hub->seq = 0;
+    hub->vport = -1;
+    hub->queue_id = -1;
+    hub->trigger_fds[0] = hub->trigger_fds[1] = -1;
+    hub->doInput = false;
+    hub->nClients = 0;
+    pthread_mutex_init( &hub->mutex, NULL );
+
+    bool ok = snd_seq_open( &hub->seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK ) >= 0;
+    if ( !ok ) hub->seq = 0;
+    if ( ok ) {
+      snd_seq_set_client_name( hub->seq, clientName.c_str() );
+#ifndef AVOID_TIMESTAMPING
+      hub->queue_id = snd_seq_alloc_named_queue( hub->seq, "RtMidi Hub Queue" );
+      ok = hub->queue_id >= 0;
+      if ( ok ) {
+        snd_seq_queue_tempo_t *qtempo;
+        snd_seq_queue_tempo_alloca(&qtempo);
+        snd_seq_queue_tempo_set_tempo(qtempo, 600000);
+        snd_seq_queue_tempo_set_ppq(qtempo, 240);
+        snd_seq_set_queue_tempo(hub->seq, hub->queue_id, qtempo);
+        snd_seq_start_queue( hub->seq, hub->queue_id, NULL );
+        snd_seq_drain_output( hub->seq );
+      }
+#endif
+    }
+    if ( ok ) {
+      hub->vport = alsaCreateInputPort( hub->seq, hub->queue_id, "RtMidi Hub Input" );
+      ok = hub->vport >= 0 && pipe( hub->trigger_fds ) == 0;
+    }
+    if ( ok ) {
+      fcntl( hub->trigger_fds[0], F_SETFL, O_NONBLOCK );
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+      pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+      hub->doInput = true;
+      if ( pthread_create(&hub->thread, &attr, alsaMidiHubHandler, hub) ) {
+        hub->doInput = false;
+        ok = false;
+      }
+      pthread_attr_destroy(&attr);
+    }
+    if ( !ok ) {
+      alsaHubDestroy( hub );
+      pthread_mutex_unlock( &alsaHubMutex );
+      return 0;
+    }
+    alsaHub = hub;
+  }
+
+  AlsaMidiHub *hub = alsaHub;
+  hub->nClients++;
+  pthread_mutex_unlock( &alsaHubMutex );
+  return hub;
+}
+
+static void alsaHubRelease( AlsaMidiHub *hub )
+{
+  pthread_mutex_lock( &alsaHubMutex );
+  if ( --hub->nClients == 0 ) {
+    alsaHub = 0;
+    alsaHubDestroy( hub );
+  }
+  pthread_mutex_unlock( &alsaHubMutex );
+}
+
+// Remove the routes of an input, either its subscriptions or its
+// virtual port.  A source is unsubscribed once no route uses it.
+static void alsaHubRemoveRoutes( AlsaMidiHub *hub, RtMidiIn::RtMidiInData *data, bool virtualPort )
+{
+  pthread_mutex_lock( &hub->mutex );
+  std::vector<AlsaMidiRoute>& routes = hub->routes;
+  for ( size_t i = 0; i < routes.size(); ) {
+    if ( routes[i].data != data || ( routes[i].vport >= 0 ) != virtualPort ) {
+      ++i;
+      continue;
+    }
+    AlsaMidiRoute route = routes[i];
+    routes.erase( routes.begin() + i );
+    if ( virtualPort ) continue;
+
+    bool shared = false;
+    for ( size_t j = 0; j < routes.size(); j++ ) {
+      if ( routes[j].vport < 0 && routes[j].source.client == route.source.client &&
+           routes[j].source.port == route.source.port ) shared = true;
+    }
+    if ( !shared ) {
+      snd_seq_disconnect_from( hub->seq, hub->vport, route.source.client, route.source.port );
+    }
+  }
+  pthread_mutex_unlock( &hub->mutex );
+}
+
 void RtMidiIn :: initialize( const std::string& clientName )
 {
+  // Save our api-specific connection information.
+  AlsaMidiData *data = (AlsaMidiData *) new AlsaMidiData;
+  data->seq = 0;
+  data->vport = -1;
+  data->subscription = 0;
+  data->lastTime = 0;
+  data->queue_id = -1;
+  data->trigger_fds[0] = data->trigger_fds[1] = -1;
+  data->hub = 0;
+  apiData_ = (void *) data;
+  inputData_.apiData = (void *) data;
+
+  // Each input decodes its own events, also in hub mode.
+  data->bufferSize = 32;
+  data->coder = 0;
+  data->buffer = 0;
+  int result = snd_midi_event_new( 0, &data->coder );
+  if ( result < 0 ) {
+    errorString_ = "RtMidiIn::initialize: error initializing MIDI event parser!";
+    error( RtError::DRIVER_ERROR );
+  }
+  data->buffer = (unsigned char *) malloc( data->bufferSize );
+  if ( data->buffer == NULL ) {
+    errorString_ = "RtMidiIn::initialize: error allocating buffer memory!";
+    error( RtError::MEMORY_ERROR );
+  }
+  snd_midi_event_init( data->coder );
+  snd_midi_event_no_status( data->coder, 1 ); // suppress running status messages
+
+  if ( hubMode_ ) {
+    data->hub = alsaHubAcquire( clientName );
+    if ( data->hub == 0 ) {
+      errorString_ = "RtMidiIn::initialize: error creating the shared ALSA sequencer client.";
+      error( RtError::DRIVER_ERROR );
+    }
+    data->seq = data->hub->seq;
+    data->queue_id = data->hub->queue_id;
+    return;
+  }
+
   // Set up the ALSA sequencer client.
   snd_seq_t *seq;
-  int result = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+  result = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
   if ( result < 0 ) {
     errorString_ = "RtMidiIn::initialize: error creating ALSA sequencer input client object.";
     error( RtError::DRIVER_ERROR );
@@ -1064,13 +1847,14 @@ void RtMidiIn :: initialize( const std::string& clientName )
 
   // Set client name.
   snd_seq_set_client_name( seq, clientName.c_str() );
-
-  // Save our api-specific connection information.
-  AlsaMidiData *data = (AlsaMidiData *) new AlsaMidiData;
   data->seq = seq;
-  data->vport = -1;
-  apiData_ = (void *) data;
-  inputData_.apiData = (void *) data;
+
+  // Create the pipe used to wake the input thread when shutting down.
+  if ( pipe( data->trigger_fds ) == -1 ) {
+    errorString_ = "RtMidiIn::initialize: error creating pipe objects.";
+    error( RtError::DRIVER_ERROR );
+  }
+  fcntl( data->trigger_fds[0], F_SETFL, O_NONBLOCK );
 
   // Create the input queue
 #ifndef AVOID_TIMESTAMPING
@@ -1143,24 +1927,38 @@ void RtMidiIn :: openPort( unsigned int portNumber, const std::string portName )
   snd_seq_addr_t sender, receiver;
   sender.client = snd_seq_port_info_get_client( pinfo );
   sender.port = snd_seq_port_info_get_port( pinfo );
+
+  if ( data->hub ) {
+    // Subscribe the source to the hub port, unless another input
+    // already has, and route its events here.
+    AlsaMidiHub *hub = data->hub;
+    AlsaMidiRoute route;
+    route.source = sender;
+    route.vport = -1;
+    route.data = &inputData_;
+
+    pthread_mutex_lock( &hub->mutex );
+    bool subscribed = false;
+    for ( size_t i = 0; i < hub->routes.size(); i++ ) {
+      if ( hub->routes[i].vport < 0 && hub->routes[i].source.client == sender.client &&
+           hub->routes[i].source.port == sender.port ) subscribed = true;
+    }
+    if ( !subscribed && snd_seq_connect_from( hub->seq, hub->vport, sender.client, sender.port ) < 0 ) {
+      pthread_mutex_unlock( &hub->mutex );
+      errorString_ = "RtMidiIn::openPort: ALSA error making port connection.";
+      error( RtError::DRIVER_ERROR );
+    }
+    inputData_.doInput = true;
+    hub->routes.push_back( route );
+    pthread_mutex_unlock( &hub->mutex );
+
+    connected_ = true;
+    return;
+  }
+
   receiver.client = snd_seq_client_id( data->seq );
   if ( data->vport < 0 ) {
-    snd_seq_port_info_set_client( pinfo, 0 );
-    snd_seq_port_info_set_port( pinfo, 0 );
-    snd_seq_port_info_set_capability( pinfo,
-                                      SND_SEQ_PORT_CAP_WRITE |
-                                      SND_SEQ_PORT_CAP_SUBS_WRITE );
-    snd_seq_port_info_set_type( pinfo,
-                                SND_SEQ_PORT_TYPE_MIDI_GENERIC |
-                                SND_SEQ_PORT_TYPE_APPLICATION );
-    snd_seq_port_info_set_midi_channels(pinfo, 16);
-#ifndef AVOID_TIMESTAMPING
-    snd_seq_port_info_set_timestamping(pinfo, 1);
-    snd_seq_port_info_set_timestamp_real(pinfo, 1);    
-    snd_seq_port_info_set_timestamp_queue(pinfo, data->queue_id);
-#endif
-    snd_seq_port_info_set_name(pinfo,  portName.c_str() );
-    data->vport = snd_seq_create_port(data->seq, pinfo);
+    data->vport = alsaCreateInputPort( data->seq, data->queue_id, portName );
   
     if ( data->vport < 0 ) {
       errorString_ = "RtMidiIn::openPort: ALSA error creating input port.";
@@ -1210,27 +2008,23 @@ void RtMidiIn :: openVirtualPort( std::string portName )
 {
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   if ( data->vport < 0 ) {
-    snd_seq_port_info_t *pinfo;
-    snd_seq_port_info_alloca( &pinfo );
-    snd_seq_port_info_set_capability( pinfo,
-				      SND_SEQ_PORT_CAP_WRITE |
-				      SND_SEQ_PORT_CAP_SUBS_WRITE );
-    snd_seq_port_info_set_type( pinfo,
-				SND_SEQ_PORT_TYPE_MIDI_GENERIC |
-				SND_SEQ_PORT_TYPE_APPLICATION );
-    snd_seq_port_info_set_midi_channels(pinfo, 16);
-#ifndef AVOID_TIMESTAMPING
-    snd_seq_port_info_set_timestamping(pinfo, 1);
-    snd_seq_port_info_set_timestamp_real(pinfo, 1);    
-    snd_seq_port_info_set_timestamp_queue(pinfo, data->queue_id);
-#endif
-    snd_seq_port_info_set_name(pinfo, portName.c_str());
-    data->vport = snd_seq_create_port(data->seq, pinfo);
+    data->vport = alsaCreateInputPort( data->seq, data->queue_id, portName );
 
     if ( data->vport < 0 ) {
       errorString_ = "RtMidiIn::openVirtualPort: ALSA error creating virtual port.";
       error( RtError::DRIVER_ERROR );
     }
+
+    if ( data->hub ) {
+      AlsaMidiRoute route;
+      route.source.client = route.source.port = 0;
+      route.vport = data->vport;
+      route.data = &inputData_;
+      pthread_mutex_lock( &data->hub->mutex );
+      inputData_.doInput = true;
+      data->hub->routes.push_back( route );
+      pthread_mutex_unlock( &data->hub->mutex );
+    }
   }
 
   if ( inputData_.doInput == false ) {
@@ -1262,6 +2056,12 @@ void RtMidiIn :: closePort( void )
 {
   if ( connected_ ) {
     AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+    if ( data->hub ) {
+      // The hub queue keeps running for the other inputs.
+      alsaHubRemoveRoutes( data->hub, &inputData_, false );
+      connected_ = false;
+      return;
+    }
     snd_seq_unsubscribe_port( data->seq, data->subscription );
     snd_seq_port_subscribe_free( data->subscription );
     // Stop the input queue
@@ -1278,23 +2078,48 @@ RtMidiIn :: ~RtMidiIn()
   // Close a connection if it exists.
   closePort();
 
-  // Shutdown the input thread.
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  if ( inputData_.doInput ) {
+  if ( data->hub ) {
+    // Once its routes are gone the hub thread no longer touches this
+    // input, so it is safe to tear down.
+    alsaHubRemoveRoutes( data->hub, &inputData_, true );
     inputData_.doInput = false;
-    pthread_join( data->thread, NULL );
+    if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
+    alsaHubRelease( data->hub );
   }
+  else {
+    // Shutdown the input thread.
+    if ( inputData_.doInput ) {
+      inputData_.doInput = false;
+      int res = write( data->trigger_fds[1], &inputData_.doInput, sizeof( inputData_.doInput ) );
+      (void) res;
+      pthread_join( data->thread, NULL );
+    }
+    close( data->trigger_fds[0] );
+    close( data->trigger_fds[1] );
 
-  // Cleanup.
-  if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
+    // Cleanup.
+    if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
 #ifndef AVOID_TIMESTAMPING
-  snd_seq_free_queue( data->seq, data->queue_id );
+    snd_seq_free_queue( data->seq, data->queue_id );
 #endif
-  snd_seq_close( data->seq );
+    snd_seq_close( data->seq );
+  }
+  snd_midi_event_free( data->coder );
+  free( data->buffer );
   delete data;
+}
 
-  // Delete the MIDI queue.
-  if ( inputData_.queue.ringSize > 0 ) delete [] inputData_.queue.ring;
+double RtMidiIn :: getTime()
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->queue_id < 0 ) return 0.0;
+
+  snd_seq_queue_status_t *status;
+  snd_seq_queue_status_alloca( &status );
+  if ( snd_seq_get_queue_status( data->seq, data->queue_id, status ) < 0 ) return 0.0;
+  const snd_seq_real_time_t *time = snd_seq_queue_status_get_real_time( status );
+  return time->tv_sec + time->tv_nsec * 0.000000001;
 }
 
 unsigned int RtMidiIn :: getPortCount()
@@ -1408,6 +2233,26 @@ void RtMidiOut :: initialize( const std::string& clientName )
   }
   snd_midi_event_init( data->coder );
   apiData_ = (void *) data;
+
+  // The queue used to schedule timed messages is only allocated when
+  // first needed, since the system has few of them.
+  data->queue_id = -1;
+}
+
+// Return the queue of an output, allocating and starting it on first
+// use, or -1 if none is available.
+static int alsaOutputQueue( AlsaMidiData *data )
+{
+#ifndef AVOID_TIMESTAMPING
+  if ( data->queue_id < 0 ) {
+    data->queue_id = snd_seq_alloc_named_queue( data->seq, "RtMidi Output Queue" );
+    if ( data->queue_id >= 0 ) {
+      snd_seq_start_queue( data->seq, data->queue_id, NULL );
+      snd_seq_drain_output( data->seq );
+    }
+  }
+#endif
+  return data->queue_id;
 }
 
 void RtMidiOut :: openPort( unsigned int portNumber, const std::string portName )
@@ -1498,17 +2343,45 @@ RtMidiOut :: ~RtMidiOut()
   // Cleanup.
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
+#ifndef AVOID_TIMESTAMPING
+  if ( data->queue_id >= 0 ) snd_seq_free_queue( data->seq, data->queue_id );
+#endif
   if ( data->coder ) snd_midi_event_free( data->coder );
   if ( data->buffer ) free( data->buffer );
   snd_seq_close( data->seq );
   delete data;
 }
 
-void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
+void RtMidiOut :: sendMessage( const unsigned char *message, size_t size )
+{
+  sendEvent( message, size, -1.0 );
+}
+
+void RtMidiOut :: sendMessageAt( const unsigned char *message, size_t size, double time )
+{
+  alsaOutputQueue( static_cast<AlsaMidiData *> (apiData_) );
+  sendEvent( message, size, time < 0.0 ? 0.0 : time );
+}
+
+double RtMidiOut :: getTime()
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( alsaOutputQueue( data ) < 0 ) return 0.0;
+
+  snd_seq_queue_status_t *status;
+  snd_seq_queue_status_alloca( &status );
+  if ( snd_seq_get_queue_status( data->seq, data->queue_id, status ) < 0 ) return 0.0;
+  const snd_seq_real_time_t *time = snd_seq_queue_status_get_real_time( status );
+  return time->tv_sec + time->tv_nsec * 0.000000001;
+}
+
+// Encode and output one message, directly if time is negative and
+// otherwise scheduled on the output queue.
+void RtMidiOut :: sendEvent( const unsigned char *message, size_t size, double time )
 {
   int result;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  unsigned int nBytes = message->size();
+  unsigned int nBytes = size;
   if ( nBytes > data->bufferSize ) {
     data->bufferSize = nBytes;
     result = snd_midi_event_resize_buffer ( data->coder, nBytes);
@@ -1516,34 +2389,49 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
       errorString_ = "RtMidiOut::sendMessage: ALSA error resizing MIDI event buffer.";
       error( RtError::DRIVER_ERROR );
     }
-    free (data->buffer);
-    data->buffer = (unsigned char *) malloc( data->bufferSize );
-    if ( data->buffer == NULL ) {
-    errorString_ = "RtMidiOut::initialize: error allocating buffer memory!\n\n";
-    error( RtError::MEMORY_ERROR );
-    }
   }
 
+  // The encoder reads the message in place.
   snd_seq_event_t ev;
   snd_seq_ev_clear(&ev);
   snd_seq_ev_set_source(&ev, data->vport);
   snd_seq_ev_set_subs(&ev);
-  snd_seq_ev_set_direct(&ev);
-  for ( unsigned int i=0; i<nBytes; ++i ) data->buffer[i] = message->at(i);
-  result = snd_midi_event_encode( data->coder, data->buffer, (long)nBytes, &ev );
-  if ( result < (int)nBytes ) {
+  if ( time < 0.0 || data->queue_id < 0 )
+    snd_seq_ev_set_direct(&ev);
+  else {
+    snd_seq_real_time_t rtime;
+    rtime.tv_sec = (unsigned int) time;
+    rtime.tv_nsec = (unsigned int) ( ( time - rtime.tv_sec ) * 1000000000.0 );
+    snd_seq_ev_schedule_real(&ev, data->queue_id, 0, &rtime);
+  }
+  result = snd_midi_event_encode( data->coder, message, (long)nBytes, &ev );
+  if ( result < (int)nBytes || ev.type == SND_SEQ_EVENT_NONE ) {
+    snd_midi_event_reset_encode( data->coder );
     errorString_ = "RtMidiOut::sendMessage: event parsing error!";
     error( RtError::WARNING );
     return;
   }
 
-  // Send the event.
+  // Queue the event, draining a full output buffer to make room.
   result = snd_seq_event_output(data->seq, &ev);
+  if ( result == -EAGAIN ) {
+    snd_seq_drain_output(data->seq);
+    result = snd_seq_event_output(data->seq, &ev);
+  }
   if ( result < 0 ) {
     errorString_ = "RtMidiOut::sendMessage: error sending MIDI message to port.";
     error( RtError::WARNING );
+    return;
   }
-  snd_seq_drain_output(data->seq);
+  flushCount_.events++;
+  flushCount_.bytes += nBytes;
+  if ( !deferFlush_ ) snd_seq_drain_output(data->seq);
+}
+
+void RtMidiOut :: drainOutput()
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_drain_output( data->seq );
 }
 
 #endif // __LINUX_ALSA__
@@ -1566,6 +2454,8 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 // Irix MIDI header file.
@@ -1640,20 +2530,9 @@ extern "C" void *irixMidiHandler( void *ptr )
           if ( event.sysexmsg[event.msglen-1] == 0xF7 ) continueSysex = false;
           if ( !continueSysex ) {
             // If not a continuing sysex message, invoke the user callback function or queue the message.
-            if ( data->usingCallback && message.bytes.size() > 0 ) {
-              RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-              callback( message.timeStamp, &message.bytes, data->userData );
-            }
-            else {
-              // As long as we haven't reached our queue size limit, push the message.
-              if ( data->queue.size < data->queue.ringSize ) {
-                data->queue.ring[data->queue.back++] = message;
-                if ( data->queue.back == data->queue.ringSize )
-                  data->queue.back = 0;
-                data->queue.size++;
-              }
-              else
-                std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
+            if ( message.bytes.size() > 0 ) {
+              deliverMidiMessage( data, message );
+              flushMidiBatch( data );
             }
             message.bytes.clear();
           }
@@ -1685,23 +2564,10 @@ extern "C" void *irixMidiHandler( void *ptr )
 
     // Copy the MIDI data to our vector.
     if ( size ) {
-      message.bytes.assign( &event.msg[0], &event.msg[size] );
+      message.bytes.assign( (unsigned char *) &event.msg[0], (unsigned char *) &event.msg[size] );
       // Invoke the user callback function or queue the message.
-      if ( data->usingCallback ) {
-        RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-        callback( message.timeStamp, &message.bytes, data->userData );
-      }
-      else {
-        // As long as we haven't reached our queue size limit, push the message.
-        if ( data->queue.size < data->queue.ringSize ) {
-          data->queue.ring[data->queue.back++] = message;
-          if ( data->queue.back == data->queue.ringSize )
-            data->queue.back = 0;
-          data->queue.size++;
-        }
-        else
-          std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
-      }
+      deliverMidiMessage( data, message );
+      flushMidiBatch( data );
       message.bytes.clear();
     }
   }
@@ -1799,9 +2665,11 @@ RtMidiIn :: ~RtMidiIn()
   // Cleanup.
   IrixMidiData *data = static_cast<IrixMidiData *> (apiData_);
   delete data;
+}
 
-  // Delete the MIDI queue.
-  if ( inputData_.queue.ringSize > 0 ) delete [] inputData_.queue.ring;
+double RtMidiIn :: getTime()
+{
+  return 0.0;
 }
 
 unsigned int RtMidiIn :: getPortCount()
@@ -1930,27 +2798,27 @@ RtMidiOut :: ~RtMidiOut()
   delete data;
 }
 
-void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
+void RtMidiOut :: sendMessage( const unsigned char *message, size_t size )
 {
   int result;
   MDevent event;
   IrixMidiData *data = static_cast<IrixMidiData *> (apiData_);
   char *buffer = 0;
 
-  unsigned int nBytes = message->size();
+  unsigned int nBytes = size;
   if ( nBytes == 0 ) return;
   event.stamp = 0;
-  if ( message->at(0) == 0xF0 ) {
+  if ( message[0] == 0xF0 ) {
     if ( nBytes < 3 ) return; // check for bogus sysex
     event.msg[0] = 0xF0;
     event.msglen = nBytes;
     buffer = (char *) malloc( nBytes );
-    for ( int i=0; i<nBytes; ++i ) buffer[i] = message->at(i);
+    for ( int i=0; i<nBytes; ++i ) buffer[i] = message[i];
     event.sysexmsg = buffer;
   }
   else {
     for ( int i=0; i<nBytes; ++i )
-      event.msg[i] = message->at(i);
+      event.msg[i] = message[i];
   }
 
   // Send the event.
@@ -1961,6 +2829,23 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
     error( RtError::WARNING );
     return;
   }
+  flushCount_.events++;
+  flushCount_.bytes += nBytes;
+}
+
+void RtMidiOut :: drainOutput()
+{
+  // Messages are sent immediately, so there is nothing to flush.
+}
+
+void RtMidiOut :: sendMessageAt( const unsigned char *message, size_t size, double /*time*/ )
+{
+  sendMessage( message, size );
+}
+
+double RtMidiOut :: getTime()
+{
+  return 0.0;
 }
 
 #endif // __IRIX_MD__
@@ -2077,21 +2962,8 @@ static void CALLBACK midiInputCallback( HMIDIIN hmin,
     else return;
   }
 
-  if ( data->usingCallback ) {
-    RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-    callback( apiData->message.timeStamp, &apiData->message.bytes, data->userData );
-  }
-  else {
-    // As long as we haven't reached our queue size limit, push the message.
-    if ( data->queue.size < data->queue.ringSize ) {
-      data->queue.ring[data->queue.back++] = apiData->message;
-      if ( data->queue.back == data->queue.ringSize )
-        data->queue.back = 0;
-      data->queue.size++;
-    }
-    else
-      std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
-  }
+  deliverMidiMessage( data, apiData->message );
+  flushMidiBatch( data );
 
   // Clear the vector for the next input message.
   apiData->message.bytes.clear();
@@ -2218,9 +3090,11 @@ RtMidiIn :: ~RtMidiIn()
   // Cleanup.
   WinMidiData *data = static_cast<WinMidiData *> (apiData_);
   delete data;
+}
 
-  // Delete the MIDI queue.
-  if ( inputData_.queue.ringSize > 0 ) delete [] inputData_.queue.ring;
+double RtMidiIn :: getTime()
+{
+  return 0.0;
 }
 
 unsigned int RtMidiIn :: getPortCount()
@@ -2369,9 +3243,9 @@ RtMidiOut :: ~RtMidiOut()
   delete data;
 }
 
-void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
+void RtMidiOut :: sendMessage( const unsigned char *message, size_t size )
 {
-  unsigned int nBytes = static_cast<unsigned int>(message->size());
+  unsigned int nBytes = static_cast<unsigned int>(size);
   if ( nBytes == 0 ) {
     errorString_ = "RtMidiOut::sendMessage: message argument is empty!";
     error( RtError::WARNING );
@@ -2380,7 +3254,7 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
 
   MMRESULT result;
   WinMidiData *data = static_cast<WinMidiData *> (apiData_);
-  if ( message->at(0) == 0xF0 ) { // Sysex message
+  if ( message[0] == 0xF0 ) { // Sysex message
 
     // Allocate buffer for sysex data.
     char *buffer = (char *) malloc( nBytes );
@@ -2390,7 +3264,7 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
     }
 
     // Copy data to buffer.
-    for ( unsigned int i=0; i<nBytes; ++i ) buffer[i] = message->at(i);
+    for ( unsigned int i=0; i<nBytes; ++i ) buffer[i] = message[i];
 
     // Create and prepare MIDIHDR structure.
     MIDIHDR sysex;
@@ -2430,7 +3304,7 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
     DWORD packet;
     unsigned char *ptr = (unsigned char *) &packet;
     for ( unsigned int i=0; i<nBytes; ++i ) {
-      *ptr = message->at(i);
+      *ptr = message[i];
       ++ptr;
     }
 
@@ -2441,6 +3315,23 @@ void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
       error( RtError::DRIVER_ERROR );
     }
   }
+  flushCount_.events++;
+  flushCount_.bytes += nBytes;
+}
+
+void RtMidiOut :: drainOutput()
+{
+  // Messages are sent immediately, so there is nothing to flush.
+}
+
+void RtMidiOut :: sendMessageAt( const unsigned char *message, size_t size, double /*time*/ )
+{
+  sendMessage( message, size );
+}
+
+double RtMidiOut :: getTime()
+{
+  return 0.0;
 }
 
 #endif  // __WINDOWS_MM__
@@ -2491,19 +3382,22 @@ int jackProcessIn( jack_nframes_t nframes, void *arg )
   if ( jData->port == NULL ) return 0;
   void *buff = jack_port_get_buffer( jData->port, nframes );
 
+  // Retry coalesced controller values held back by a full queue.
+  if ( rtData->queue.nPending > 0 ) rtData->queue.flushPending();
+
+  // Compute the delta time for the first event of this cycle; the
+  // rest of the cycle's events arrive with the same time.
+  time = jack_get_time();
+
   // We have midi events in buffer
   int evCount = jack_midi_get_event_count( buff );
-  if ( evCount > 0 ) {
-    RtMidiIn::MidiMessage message;
-    message.bytes.clear();
-
-    jack_midi_event_get( &event, buff, 0 );
+  RtMidiIn::MidiMessage& message = rtData->message;
+  for ( int j = 0; j < evCount; j++ ) {
+    jack_midi_event_get( &event, buff, j );
 
-    for (unsigned int i = 0; i < event.size; i++ )
-      message.bytes.push_back( event.buffer[i] );
+    message.bytes.assign( event.buffer, event.buffer + event.size );
 
-    // Compute the delta time.
-    time = jack_get_time();
+    message.timeStamp = 0.0;
     if ( rtData->firstMessage == true )
       rtData->firstMessage = false;
     else
@@ -2511,23 +3405,13 @@ int jackProcessIn( jack_nframes_t nframes, void *arg )
 
     jData->lastTime = time;
 
-    if ( rtData->usingCallback && !rtData->continueSysex ) {
-      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) rtData->userCallback;
-      callback( message.timeStamp, &message.bytes, rtData->userData );
-    }
-    else {
-      // As long as we haven't reached our queue size limit, push the message.
-      if ( rtData->queue.size < rtData->queue.ringSize ) {
-        rtData->queue.ring[rtData->queue.back++] = message;
-        if ( rtData->queue.back == rtData->queue.ringSize )
-          rtData->queue.back = 0;
-        rtData->queue.size++;
-      }
-      else
-        std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
-    }
+    if ( !rtData->continueSysex )
+      deliverMidiMessage( rtData, message );
   }
 
+  // Everything from this process cycle goes to a batch callback at once.
+  flushMidiBatch( rtData );
+
   return 0;
 }
 
@@ -2558,9 +3442,6 @@ RtMidiIn :: ~RtMidiIn()
 {
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
   jack_client_close( data->client );
-
-  // Delete the MIDI queue.
-  if ( inputData_.queue.ringSize > 0 ) delete [] inputData_.queue.ring;
 }
 
 void RtMidiIn :: openPort( unsigned int portNumber, const std::string portName )
@@ -2596,6 +3477,11 @@ void RtMidiIn :: openVirtualPort( const std::string portName )
   }
 }
 
+double RtMidiIn :: getTime()
+{
+  return 0.0;
+}
+
 unsigned int RtMidiIn :: getPortCount()
 {
   int count = 0;
@@ -2800,15 +3686,31 @@ void RtMidiOut :: closePort()
   data->port = NULL;
 }
 
-void RtMidiOut :: sendMessage( std::vector<unsigned char> *message )
+void RtMidiOut :: sendMessage( const unsigned char *message, size_t size )
 {
-  int nBytes = message->size();
+  int nBytes = size;
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
 
   // Write full message to buffer
-  jack_ringbuffer_write( data->buffMessage, ( const char * ) &( *message )[0],
-                         message->size() );
+  jack_ringbuffer_write( data->buffMessage, ( const char * ) message, size );
   jack_ringbuffer_write( data->buffSize, ( char * ) &nBytes, sizeof( nBytes ) );
+  flushCount_.events++;
+  flushCount_.bytes += nBytes;
+}
+
+void RtMidiOut :: drainOutput()
+{
+  // The process callback sends queued messages every cycle.
+}
+
+void RtMidiOut :: sendMessageAt( const unsigned char *message, size_t size, double /*time*/ )
+{
+  sendMessage( message, size );
+}
+
+double RtMidiOut :: getTime()
+{
+  return 0.0;
 }
 
 #endif  // __LINUX_JACK__
@@ -43,6 +43,74 @@
 #include "RtError.h"
 #include <string>
 
+/**********************************************************************/
+/*! \struct MidiStatusInfo
+    \brief Decoding information for one MIDI status byte.
+
+    midiStatusTable holds one entry for each of the 256 byte values,
+    so that decoding a status byte is a single table lookup.  The
+    handler index is dense over the channel-voice kinds, with every
+    other byte sharing the last index, so that it can index an array
+    of MIDI_HANDLER_COUNT dispatch functions directly.
+*/
+/**********************************************************************/
+
+//! The kinds of MIDI message, channel-voice kinds in status order.
+enum MidiMessageKind {
+  MIDI_NOTE_OFF,          /*!< 0x8n */
+  MIDI_NOTE_ON,           /*!< 0x9n */
+  MIDI_POLY_PRESSURE,     /*!< 0xAn */
+  MIDI_CONTROL_CHANGE,    /*!< 0xBn */
+  MIDI_PROGRAM_CHANGE,    /*!< 0xCn */
+  MIDI_CHANNEL_PRESSURE,  /*!< 0xDn */
+  MIDI_PITCH_WHEEL,       /*!< 0xEn */
+  MIDI_SYSTEM,            /*!< 0xF0 - 0xFF */
+  MIDI_DATA               /*!< Not a status byte. */
+};
+
+//! The number of dispatch handlers a MidiStatusInfo::handler can select.
+const unsigned int MIDI_HANDLER_COUNT = MIDI_SYSTEM + 1;
+
+struct MidiStatusInfo {
+  unsigned char kind;     /*!< A MidiMessageKind. */
+  unsigned char channel;  /*!< The channel (0 - 15) of a channel-voice status. */
+  unsigned char length;   /*!< The complete message length in bytes, 0 if variable or not a status byte. */
+  unsigned char handler;  /*!< The dispatch index, MIDI_SYSTEM for anything but channel-voice. */
+};
+
+// Message lengths of the system status bytes 0xF0 - 0xFF.
+constexpr unsigned char midiSystemLength( unsigned int status )
+{
+  return status == 0xF0 ? 0 : ( status == 0xF1 || status == 0xF3 ) ? 2 : status == 0xF2 ? 3 : 1;
+}
+
+constexpr MidiStatusInfo midiStatusInfo( unsigned int status )
+{
+  return status < 0x80 ? MidiStatusInfo{ MIDI_DATA, 0, 0, MIDI_SYSTEM } :
+    status >= 0xF0 ? MidiStatusInfo{ MIDI_SYSTEM, 0, midiSystemLength( status ), MIDI_SYSTEM } :
+    MidiStatusInfo{ (unsigned char) ( ( status >> 4 ) - 8 ), (unsigned char) ( status & 0x0F ),
+                    (unsigned char) ( ( status & 0xE0 ) == 0xC0 ? 2 : 3 ),
+                    (unsigned char) ( ( status >> 4 ) - 8 ) };
+}
+
+#define RTMIDI_STATUS4( n ) midiStatusInfo( n ), midiStatusInfo( n + 1 ), midiStatusInfo( n + 2 ), midiStatusInfo( n + 3 )
+#define RTMIDI_STATUS16( n ) RTMIDI_STATUS4( n ), RTMIDI_STATUS4( n + 4 ), RTMIDI_STATUS4( n + 8 ), RTMIDI_STATUS4( n + 12 )
+#define RTMIDI_STATUS64( n ) RTMIDI_STATUS16( n ), RTMIDI_STATUS16( n + 16 ), RTMIDI_STATUS16( n + 32 ), RTMIDI_STATUS16( n + 48 )
+
+//! Decoding information indexed by status byte.
+constexpr MidiStatusInfo midiStatusTable[256] = {
+  RTMIDI_STATUS64( 0 ), RTMIDI_STATUS64( 64 ), RTMIDI_STATUS64( 128 ), RTMIDI_STATUS64( 192 )
+};
+
+#undef RTMIDI_STATUS64
+#undef RTMIDI_STATUS16
+#undef RTMIDI_STATUS4
+
+static_assert( midiStatusTable[0xC5].kind == MIDI_PROGRAM_CHANGE && midiStatusTable[0xC5].length == 2 &&
+               midiStatusTable[0xC5].channel == 5 && midiStatusTable[0xEF].length == 3 &&
+               midiStatusTable[0xF2].length == 3 && midiStatusTable[0x7F].kind == MIDI_DATA,
+               "midiStatusTable is malformed" );
+
 class RtMidi
 {
  public:
@@ -96,6 +164,7 @@ class RtMidi
 /**********************************************************************/
 
 #include <vector>
+#include <atomic>
 
 class RtMidiIn : public RtMidi
 {
@@ -104,19 +173,76 @@ class RtMidiIn : public RtMidi
   //! User callback function type definition.
   typedef void (*RtMidiCallback)( double timeStamp, std::vector<unsigned char> *message, void *userData);
 
+  //! User callback function type definition taking a pointer and length.
+  /*!
+      The bytes are only valid for the duration of the callback.
+      Unlike RtMidiCallback, this form never requires the input thread
+      to copy the message into a std::vector.
+  */
+  typedef void (*RtMidiRawCallback)( double timeStamp, const unsigned char *message, unsigned int size, void *userData );
+
+  //! A single message as handed to a batch callback.
+  /*!
+      The bytes point into storage owned by the RtMidiIn object and
+      are only valid for the duration of the callback.
+  */
+  struct MidiRecord {
+    double timeStamp;
+    const unsigned char *bytes;
+    unsigned int size;
+  };
+
+  //! Batch callback function type definition.
+  typedef void (*RtMidiBatchCallback)( const MidiRecord *records, unsigned int nRecords, void *userData );
+
+  //! A decoded channel-voice message as handed to an event callback.
+  struct MidiEvent {
+    double timeStamp;       /*!< Delta time in seconds, as for the byte callbacks. */
+    double time;            /*!< Absolute time in seconds on the getTime() clock, 0 if the API has none. */
+    unsigned char type;     /*!< The status nibble, 0x80 (note off) to 0xE0 (pitch wheel). */
+    unsigned char channel;  /*!< The channel, 0 to 15. */
+    unsigned char data1;    /*!< Note, controller, program or pressure value. */
+    unsigned char data2;    /*!< Velocity, controller value or key pressure; 0 for 2-byte messages. */
+    unsigned short value14; /*!< data1 | (data2 << 7), i.e. the 14-bit pitch wheel value. */
+  };
+
+  //! Event callback function type definition.
+  typedef void (*RtMidiEventCallback)( const MidiEvent *events, unsigned int nEvents, void *userData );
+
   //! Default constructor that allows an optional client name and queue size.
   /*!
       An exception will be thrown if a MIDI system initialization
       error occurs.  The queue size defines the maximum number of
       messages that can be held in the MIDI queue (when not using a
       callback function).  If the queue size limit is reached,
-      incoming messages will be ignored.
+      incoming messages will be ignored.  The queue storage is rounded
+      up to a power of two.
   */
   RtMidiIn( const std::string clientName = std::string( "RtMidi Input Client"), unsigned int queueSizeLimit = 100 );
 
   //! If a MIDI connection is still open, it will be closed by the destructor.
   ~RtMidiIn();
 
+  //! Return the current time, in seconds, of the clock that stamps MidiEvent::time.
+  /*!
+      With ALSA this is the real time of the sequencer queue that
+      timestamps incoming events, sampled together with another clock
+      to relate event times to it.  APIs without such a clock return 0.
+  */
+  double getTime();
+
+  //! Share one system client between all RtMidiIn instances constructed after this call (ALSA only).
+  /*!
+      In hub mode the instances share a single sequencer client,
+      queue and input thread rather than each creating their own.
+      Events are routed to the instance that opened their source port
+      (or, for virtual ports, to the instance owning the destination
+      port).  Callbacks of all hub instances run on the one input
+      thread, so a callback must not construct, open, close or destroy
+      a hub instance.  This function has no effect for the other APIs.
+  */
+  static void setHubMode( bool enable );
+
   //! Open a MIDI input connection.
   /*!
       An optional port number greater than 0 can be specified.
@@ -142,6 +268,38 @@ class RtMidiIn : public RtMidi
   */
   void setCallback( RtMidiCallback callback, void *userData = 0 );
 
+  //! Set a callback function that receives the message bytes as a pointer and length.
+  /*!
+      This behaves like the std::vector form of setCallback() but
+      avoids copying each message into a vector, so the input thread
+      does not allocate memory in steady state.
+  */
+  void setCallback( RtMidiRawCallback callback, void *userData = 0 );
+
+  //! Set a callback function to be invoked with all messages received in one input wakeup.
+  /*!
+      Instead of one call per message, the callback receives every
+      message decoded during one wakeup of the input thread (ALSA) or
+      one process cycle (JACK) as a contiguous array of records.  The
+      other APIs deliver one record per call.  Only one of setCallback()
+      and setBatchCallback() can be in use at a time.
+  */
+  void setBatchCallback( RtMidiBatchCallback callback, void *userData = 0 );
+
+  //! Set a callback function to be invoked with decoded channel-voice messages.
+  /*!
+      Note, aftertouch, controller, program change, channel pressure
+      and pitch wheel messages are delivered as MidiEvent structures,
+      batched per input wakeup like setBatchCallback().  With ALSA the
+      events are read straight from the sequencer event fields without
+      being encoded into MIDI bytes first.  All other messages still
+      go to the byte callback or the queue.
+  */
+  void setEventCallback( RtMidiEventCallback callback, void *userData = 0 );
+
+  //! Cancel use of the event callback (if one exists).
+  void cancelEventCallback();
+
   //! Cancel use of the current callback function (if one exists).
   /*!
       Subsequent incoming MIDI messages will be written to the queue
@@ -181,27 +339,174 @@ o      By default, MIDI timing and active sensing messages are ignored
   */
   double getMessage( std::vector<unsigned char> *message );
 
-  // A MIDI structure used internally by the class to store incoming
-  // messages.  Each message represents one and only one MIDI message.
+  struct MidiMessage;
+
+  //! Move up to \e maxMessages queued messages into the user-provided array and return how many were moved.
+  /*!
+      This function returns immediately and never blocks the input
+      thread, so it is safe to call from a polling loop.  The
+      messages' byte buffers are reused, so draining into the same
+      array repeatedly does not allocate memory for ordinary traffic.
+      An exception is thrown if an error occurs during message
+      retrieval or an input connection was not previously established.
+  */
+  unsigned int getMessages( MidiMessage *messages, unsigned int maxMessages );
+
+  //! Policies for incoming messages that arrive while the queue is full.
+  enum QueueOverflowPolicy {
+    QUEUE_DROP_NEWEST,  /*!< Discard the incoming message (the default). */
+    QUEUE_DROP_OLDEST,  /*!< Discard the oldest queued message to make room. */
+    QUEUE_COALESCE      /*!< Hold back the latest value of each controller, pitch wheel and pressure stream until there is room, discarding superseded values.  Other messages are dropped. */
+  };
+
+  //! Select what happens to incoming messages when the queue is full.
+  /*!
+      This only affects queue (non-callback) mode and is best set
+      before a port is opened.
+  */
+  void setQueueOverflowPolicy( QueueOverflowPolicy policy );
+
+  //! Counters describing input that was lost or could not be decoded.
+  struct InputStats {
+    unsigned long queueOverruns;   /*!< Messages dropped because the queue was full. */
+    unsigned long coalesced;       /*!< Controller values superseded while the queue was full. */
+    unsigned long bufferOverruns;  /*!< Sequencer input buffer overruns reported by the driver (ALSA -ENOSPC). */
+    unsigned long decodeErrors;    /*!< Events that could not be read or decoded into MIDI bytes. */
+  };
+
+  //! Return the input counters.
+  /*!
+      The counters are updated atomically by the input thread, so this
+      can be called from any thread without locking.  They are never
+      reset.
+  */
+  InputStats getInputStats() const;
+
+  // Byte storage for an incoming message.  Messages of up to
+  // INLINE_SIZE bytes (every channel-voice and short system message)
+  // are held inline.  Longer messages (sysex) go to a heap buffer,
+  // which is kept for reuse once allocated, so that the input path
+  // does not touch the heap in steady state.
+  class MidiBytes {
+  public:
+    enum { INLINE_SIZE = 16 };
+
+    MidiBytes() : heap_(0), heapSize_(0), size_(0) {}
+    MidiBytes( const MidiBytes& other ) : heap_(0), heapSize_(0), size_(0) { assign( other.begin(), other.end() ); }
+    ~MidiBytes() { delete [] heap_; }
+    MidiBytes& operator=( const MidiBytes& other ) { if ( this != &other ) assign( other.begin(), other.end() ); return *this; }
+
+    const unsigned char *data() const { return size_ > INLINE_SIZE ? heap_ : inline_; }
+    const unsigned char *begin() const { return data(); }
+    const unsigned char *end() const { return data() + size_; }
+    unsigned char operator[]( unsigned int i ) const { return data()[i]; }
+    unsigned char back() const { return data()[size_ - 1]; }
+    unsigned int size() const { return size_; }
+    void clear() { size_ = 0; }
+
+    void assign( const unsigned char *first, const unsigned char *last );
+    void append( const unsigned char *first, const unsigned char *last );
+    void push_back( unsigned char byte ) { append( &byte, &byte + 1 ); }
+
+  private:
+    void grow( unsigned int size );
+
+    unsigned char inline_[INLINE_SIZE];
+    unsigned char *heap_;
+    unsigned int heapSize_;
+    unsigned int size_;
+  };
+
+  // A MIDI structure used to store incoming messages.  Each message
+  // represents one and only one MIDI message.
   struct MidiMessage { 
-    std::vector<unsigned char> bytes; 
+    MidiBytes bytes; 
     double timeStamp;
+    double time; // absolute, on the getTime() clock
 
     // Default constructor.
     MidiMessage()
-      :bytes(0), timeStamp(0.0) {}
+      :timeStamp(0.0), time(0.0) {}
   };
 
+  // A lock-free single-producer/single-consumer ring of messages.  The
+  // input thread is the only writer of back and the thread calling
+  // getMessage() claims messages by advancing front.  Both are
+  // free-running counters masked into a power-of-two ring, published
+  // with release/acquire ordering and kept on separate cache lines.
+  //
+  // With QUEUE_DROP_OLDEST the producer may also advance front, so the
+  // consumer claims messages with a compare-exchange and announces the
+  // slots it is copying in reading, which the producer never
+  // overwrites.  With QUEUE_COALESCE the producer parks the latest
+  // value of each continuous controller in a private table while the
+  // ring is full and writes them out as soon as there is room.
   struct MidiQueue {
-    unsigned int front;
-    unsigned int back;
-    unsigned int size;
-    unsigned int ringSize;
-		MidiMessage *ring;
+    enum { CACHE_LINE = 64 };
+    enum { NOT_READING = 0xFFFFFFFF };
+
+    // One pending slot per channel for each controller and each
+    // key's poly pressure, plus pitch wheel and channel pressure.
+    enum { COALESCE_KEYS = 16 * 258 };
+
+    struct PendingMessage {
+      unsigned char bytes[3];
+      unsigned char size;   // zero if nothing is pending
+      double timeStamp;
+      double time;
+    };
+
+    unsigned int ringSize;  // a power of two
+    unsigned int limit;     // the maximum number of queued messages
+    MidiMessage *ring;
+    QueueOverflowPolicy policy;
+    PendingMessage *pending;       // producer only, indexed by key
+    unsigned short *pendingOrder;  // producer only, keys in arrival order
+    unsigned int nPending;
+    char pad0_[CACHE_LINE];
+    std::atomic<unsigned int> front;
+    std::atomic<unsigned int> reading;
+    char pad1_[CACHE_LINE - 2 * sizeof(std::atomic<unsigned int>)];
+    std::atomic<unsigned int> back;
+    std::atomic<unsigned long> overruns;
+    std::atomic<unsigned long> coalesced;
+    char pad2_[CACHE_LINE];
 
     // Default constructor.
     MidiQueue()
-      :front(0), back(0), size(0), ringSize(0) {}
+      :ringSize(0), limit(0), ring(0), policy(QUEUE_DROP_NEWEST), pending(0),
+       pendingOrder(0), nPending(0), front(0), reading(NOT_READING), back(0),
+       overruns(0), coalesced(0) {}
+
+    ~MidiQueue() { delete [] ring; delete [] pending; delete [] pendingOrder; }
+
+    // Producer side: queue a message according to the overflow
+    // policy, returns false if it was dropped.
+    bool push( const MidiMessage& message );
+
+    // Producer side: write out held-back controller values, returns
+    // true once none are left.
+    bool flushPending();
+
+    // Consumer side: copy up to maxMessages out, returns the count.
+    unsigned int pop( MidiMessage *messages, unsigned int maxMessages );
+
+    // Consumer side: copy the next message's bytes into a vector.
+    bool pop( std::vector<unsigned char> *bytes, double *timeStamp );
+
+    unsigned int size() const { return back.load( std::memory_order_acquire ) - front.load( std::memory_order_acquire ); }
+
+  private:
+    bool write( const unsigned char *bytes, unsigned int size, double timeStamp, double time );
+    bool coalesce( const MidiMessage& message );
+    unsigned int claim( unsigned int maxMessages, unsigned int *first );
+  };
+
+  // The kinds of user callback that can be installed.
+  enum CallbackType {
+    VECTOR_CALLBACK,
+    RAW_CALLBACK,
+    BATCH_CALLBACK
   };
 
   // The RtMidiInData structure is used to pass private class data to
@@ -214,21 +519,35 @@ o      By default, MIDI timing and active sensing messages are ignored
     bool firstMessage;
     void *apiData;
     bool usingCallback;
+    CallbackType callbackType;
     void *userCallback;
     void *userData;
     bool continueSysex;
+    std::vector<unsigned char> callbackBytes; // reused for VECTOR_CALLBACK
+    std::vector<MidiRecord> batch;
+    std::vector<unsigned char> batchBytes;
+    bool usingEventCallback;
+    void *eventCallback;
+    void *eventUserData;
+    std::vector<MidiEvent> events;
+    std::atomic<unsigned long> bufferOverruns;
+    std::atomic<unsigned long> decodeErrors;
 
     // Default constructor.
     RtMidiInData()
       : ignoreFlags(7), doInput(false), firstMessage(true),
-        apiData(0), usingCallback(false), userCallback(0), userData(0),
-        continueSysex(false) {}
+        apiData(0), usingCallback(false), callbackType(VECTOR_CALLBACK),
+        userCallback(0), userData(0), continueSysex(false),
+        usingEventCallback(false), eventCallback(0), eventUserData(0),
+        bufferOverruns(0), decodeErrors(0) {}
   };
 
  private:
 
   void initialize( const std::string& clientName );
+  void installCallback( void *callback, CallbackType type, void *userData );
   RtMidiInData inputData_;
+  static bool hubMode_;
 
 };
 
@@ -294,13 +613,69 @@ class RtMidiOut : public RtMidi
   //! Immediately send a single message out an open MIDI output port.
   /*!
       An exception is thrown if an error occurs during output or an
-      output connection was not previously established.
+      output connection was not previously established.  With deferred
+      flushing, the message is buffered until flush() is called.
   */
   void sendMessage( std::vector<unsigned char> *message );
 
+  //! Immediately send a single message given as a pointer and length.
+  /*!
+      As above, but without requiring the bytes to be held in a
+      std::vector.
+  */
+  void sendMessage( const unsigned char *message, size_t size );
+
+  //! Schedule a single message to be sent at the given time (ALSA only).
+  /*!
+      The time is in seconds on the clock returned by getTime().  A
+      time that has already passed sends the message at once.  The
+      other APIs have no output scheduling and send the message
+      immediately.  With deferred flushing, the message reaches the
+      system when flush() is called.
+  */
+  void sendMessageAt( const unsigned char *message, size_t size, double time );
+
+  //! Return the current time, in seconds, of the clock used by sendMessageAt().
+  /*!
+      The clock starts the first time getTime() or sendMessageAt() is
+      called, when ALSA allocates a sequencer queue for the output.
+      For APIs without output scheduling this returns 0.
+  */
+  double getTime();
+
+  //! Send several complete messages, stored back to back, with a single flush.
+  /*!
+      Message boundaries are found from the status bytes, so running
+      status is not allowed.  A sysex message runs up to and including
+      its 0xF7.  Sending stops with a warning at the first malformed
+      message.
+  */
+  void sendMessages( const unsigned char *messages, size_t size );
+
+  //! Output handed to the system since the previous flush().
+  struct FlushCount {
+    unsigned int events;  /*!< The number of messages. */
+    size_t bytes;         /*!< The number of MIDI bytes they held. */
+  };
+
+  //! Hold sent messages in the output buffer until flush() is called (ALSA only).
+  /*!
+      This allows all the messages generated in one processing cycle to
+      be handed to the system at once.  The other APIs send every
+      message immediately, and flush() only reports the counts.
+  */
+  void setDeferredFlush( bool deferred );
+
+  //! Send any buffered messages, and return the output since the previous flush().
+  FlushCount flush();
+
  private:
 
   void initialize( const std::string& clientName );
+  void sendEvent( const unsigned char *message, size_t size, double time );
+  void drainOutput();
+  bool deferFlush_;
+  FlushCount flushCount_;
 };
 
 #endif
@@ -0,0 +1,110 @@
+/******************************************/
+/*
+  decodebench.cpp
+
+  Compares the table-driven MIDI status decode (midiStatusTable)
+  against the arithmetic decode midimap used before it, over a
+  random stream of channel-voice messages.  Both decoders count
+  messages per kind; the table decode is correct by construction,
+  so the report also shows how many messages the old decode
+  dropped or misfiled.
+
+  usage: decodebench [messages] [passes]
+*/
+/******************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "RtMidi.h"
+
+struct Message {
+  unsigned int offset;
+  unsigned int size;
+};
+
+// The pre-table decode: a 3-byte size check and division by 0x0F.
+static unsigned long arithmeticDecode( const unsigned char *bytes, const Message *messages,
+                                       unsigned int nMessages, unsigned long counts[8] )
+{
+  unsigned long sum = 0;
+  for ( unsigned int i = 0; i < nMessages; i++ ) {
+    const unsigned char *message = bytes + messages[i].offset;
+    if ( messages[i].size != 3 ) continue;
+    int type = ( (int) message[0] - 0x80 ) / 0x0F;
+    int channel = ( (int) message[0] - 0x80 ) % 0x0F - 1;
+    if ( type < 0 || type > 6 ) continue;
+    counts[type]++;
+    sum += channel + message[1] + message[2];
+  }
+  return sum;
+}
+
+static unsigned long tableDecode( const unsigned char *bytes, const Message *messages,
+                                  unsigned int nMessages, unsigned long counts[8] )
+{
+  unsigned long sum = 0;
+  for ( unsigned int i = 0; i < nMessages; i++ ) {
+    const unsigned char *message = bytes + messages[i].offset;
+    const MidiStatusInfo& info = midiStatusTable[message[0]];
+    if ( messages[i].size < info.length ) continue;
+    counts[info.handler]++;
+    sum += info.channel + message[1] + ( info.length == 3 ? message[2] : 0 );
+  }
+  return sum;
+}
+
+typedef unsigned long (*Decoder)( const unsigned char *, const Message *, unsigned int, unsigned long * );
+
+static double run( Decoder decode, const std::vector<unsigned char>& bytes,
+                   const std::vector<Message>& messages, unsigned int passes,
+                   unsigned long counts[8], unsigned long *sum )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for ( unsigned int p = 0; p < passes; p++ ) {
+    for ( unsigned int k = 0; k < 8; k++ ) counts[k] = 0;
+    *sum += decode( &bytes[0], &messages[0], messages.size(), counts );
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ( (double) passes * messages.size() );
+}
+
+int main( int argc, char *argv[] )
+{
+  unsigned int nMessages = argc > 1 ? atoi( argv[1] ) : 1000000;
+  unsigned int passes = argc > 2 ? atoi( argv[2] ) : 20;
+  if ( nMessages == 0 || passes == 0 ) {
+    std::fprintf( stderr, "usage: decodebench [messages] [passes]\n" );
+    return 1;
+  }
+
+  std::vector<unsigned char> bytes;
+  std::vector<Message> messages( nMessages );
+  std::srand( 1 );
+  unsigned long expected[8] = { 0 };
+  for ( unsigned int i = 0; i < nMessages; i++ ) {
+    unsigned char status = 0x80 | ( std::rand() % 7 ) << 4 | ( std::rand() & 0x0F );
+    const MidiStatusInfo& info = midiStatusTable[status];
+    messages[i].offset = bytes.size();
+    messages[i].size = info.length;
+    bytes.push_back( status );
+    for ( unsigned int k = 1; k < info.length; k++ )
+      bytes.push_back( std::rand() & 0x7F );
+    expected[info.kind]++;
+  }
+
+  static const char *names[7] = { "note off", "note on", "poly pressure", "control change",
+                                  "program change", "channel pressure", "pitch wheel" };
+  unsigned long arithmetic[8], table[8], sum = 0;
+  double arithmeticNs = run( arithmeticDecode, bytes, messages, passes, arithmetic, &sum );
+  double tableNs = run( tableDecode, bytes, messages, passes, table, &sum );
+
+  std::printf( "%u messages x %u passes (checksum %lu)\n\n", nMessages, passes, sum );
+  std::printf( "%-18s %10s %10s %10s\n", "kind", "expected", "arithmetic", "table" );
+  for ( unsigned int k = 0; k < 7; k++ )
+    std::printf( "%-18s %10lu %10lu %10lu\n", names[k], expected[k], arithmetic[k], table[k] );
+  std::printf( "\narithmetic decode: %6.2f ns/message\n", arithmeticNs );
+  std::printf( "table decode:      %6.2f ns/message\n", tableNs );
+  return 0;
+}
@@ -1,22 +1,297 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
 #include "RtMidi.h"
 #include "mapper/mapper.h"
 
-#define INSTANCES 10
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
-#define NOTE_OFF 0x80
-#define NOTE_ON 0x90
-#define AFTERTOUCH 0xA0
-#define CONTROL_CHANGE 0xB0
-#define PROGRAM_CHANGE 0xC0
-#define CHANNEL_PRESSURE 0xD0
-#define PITCH_WHEEL 0xE0
+#define INSTANCES 10
+#define MAX_DEVICE_FDS 8
+#define MAX_EVENTS 32
+#define HOUSEKEEPING_MS 100
+#define EVENT_QUEUE_SIZE 1024   // must be a power of two
+#define OUTPUT_QUEUE_SIZE 256   // must be a power of two
+#define BUNDLE_WINDOW 0.001     // default seconds of MIDI input per bundle
+#define CLOCK_ALPHA 0.1         // clock map offset gain
+#define CLOCK_BETA 0.005        // clock map drift gain
+#define CLOCK_STEP 0.01         // clock map resyncs on larger errors (s)
+#define MAX_POLYPHONY 128
+#define DEFAULT_POLYPHONY 16
+#define MAX_DEVICE_CONFIGS 32
+#define CONTROL_PITCH_WHEEL 128 // coalesced controllers past CC 127
+#define CONTROL_PRESSURE 129
+#define NUM_CONTROLS 130
+#define SCHEDULER_QUEUE_SIZE 256    // must be a power of two
+#define SCHEDULER_BURST 0.005   // seconds of output rate sent at once
+#define DIN_RATE 3125           // bytes per second of a MIDI cable
+#define MAX_MPE_NOTES (16 * MAX_POLYPHONY)
 
 int done = 0;
+int async_output = 0;   // send MIDI from a thread per output port
+double latency = -1;    // fixed output latency in seconds, < 0 if off
+double bundle_window = BUNDLE_WINDOW;   // controllers coalesce within it
+int lazy_signals = 0;   // declare output signals when first needed
+int vector_signals = 0; // one vector signal per kind of channel message
+int controller_signals = 0; // a signal per controller and parameter
 mapper_timetag_t tt;
 
+// What a note-on does when every voice of its channel is sounding.
+enum {
+    STEAL_NONE,         // drop the new note
+    STEAL_OLDEST,       // end the note that started first
+    STEAL_QUIETEST      // end the note with the lowest velocity
+};
+
+const char *steal_names[] = {"none", "oldest", "quietest"};
+
+// MPE zones: the master channel is the first or last channel, and the
+// member channels follow or precede it.
+enum {
+    MPE_OFF,
+    MPE_LOWER,
+    MPE_UPPER
+};
+
+const char *mpe_names[] = {"off", "lower", "upper"};
+
+// Device settings from the command line, for one device or, without
+// a name, for all devices.
+typedef struct _midimap_device_config {
+    const char      *name;
+    int             polyphony;      // 0 if not given
+    int             steal;          // -1 if not given
+    double          rate;           // -1 if not given
+    unsigned int    channels;       // 0 if not given
+    int             mpe;            // -1 if not given
+    int             mpe_members;
+} midimap_device_config;
+
+midimap_device_config default_config = {0, DEFAULT_POLYPHONY, STEAL_OLDEST,
+                                        0, 0xFFFF, MPE_OFF, 15};
+midimap_device_config device_configs[MAX_DEVICE_CONFIGS];
+int num_device_configs = 0;
+
+#ifdef __linux__
+int epoll_fd = -1;
+int wakeup_fd = -1;     // written to interrupt epoll_wait()
+#endif
+
+struct _midimap_device;
+
+// one libmapper socket registered with the reactor
+typedef struct _midimap_watch {
+    struct _midimap_device *dev;
+    int fd;
+} midimap_watch;
+
+// Single-producer, single-consumer ring carrying MIDI events from the
+// input thread to the thread that owns the libmapper devices.
+typedef struct _midimap_event_queue {
+    std::atomic<unsigned int> head;         // written by the input thread
+    std::atomic<unsigned int> tail;         // written by the mapper thread
+    std::atomic<bool> signalled;            // a wakeup is outstanding
+    std::atomic<unsigned long> dropped;     // events lost to a full ring
+    RtMidiIn::MidiEvent events[EVENT_QUEUE_SIZE];
+} midimap_event_queue;
+
+// A channel message waiting for an output's sender thread.
+typedef struct _midimap_out_message {
+    double          time;           // output clock time, < 0 for now
+    unsigned char   bytes[3];
+    unsigned char   length;
+} midimap_out_message;
+
+// Single-producer, single-consumer ring carrying MIDI messages from
+// the mapper thread to the sender thread of one output port, so that
+// a slow port never blocks the mapper thread.
+typedef struct _midimap_output_queue {
+    std::atomic<unsigned int> head;         // written by the mapper thread
+    std::atomic<unsigned int> tail;         // written by the sender thread
+    std::atomic<bool> signalled;            // a wakeup is outstanding
+    std::atomic<unsigned long> dropped;     // messages lost to a full ring
+    std::atomic<bool> running;
+    int             wake_fd;
+#ifdef __linux__
+    pthread_t       thread;
+#endif
+    midimap_out_message messages[OUTPUT_QUEUE_SIZE];
+} midimap_output_queue;
+
+// Latest value of each continuous controller of a MIDI input, held
+// back until its bundle is sent so that a sweep costs one update per
+// bundle rather than one per MIDI message.
+typedef struct _midimap_controls {
+    int             count;
+    unsigned short  order[16 * NUM_CONTROLS];   // pending, by first update
+    short           value[16 * NUM_CONTROLS];   // -1 if not pending
+} midimap_controls;
+
+// Paces the MIDI sent to a port to a byte rate, so that a slow port
+// is not sent more than it can carry. Ordered messages (notes, key
+// pressure and program changes) wait in a FIFO and go first. Each
+// controller waits in its own slot, where a newer value replaces one
+// not yet sent.
+typedef struct _midimap_scheduler {
+    double          rate;           // bytes per second
+    double          tokens;         // bytes that may be sent now
+    double          last;           // time tokens were last added
+    unsigned int    head;
+    unsigned int    tail;
+    midimap_out_message messages[SCHEDULER_QUEUE_SIZE];
+    int             first;          // controller slots pending, in order
+    int             count;
+    unsigned short  order[16 * NUM_CONTROLS];
+    midimap_out_message controls[16 * NUM_CONTROLS];    // length 0 if free
+    unsigned int    max_depth;      // statistics
+    unsigned long   superseded;
+    unsigned long   dropped;
+} midimap_scheduler;
+
+// A registered or non-registered parameter of a MIDI input channel,
+// declared as a signal the first time data is entered for it.
+typedef struct _midimap_parameter {
+    int             key;            // channel << 15 | NRPN << 14 | number
+    int             value;          // 14-bit
+    mapper_signal   sig;
+} midimap_parameter;
+
+// Controller state of a MIDI input channel.
+typedef struct _midimap_channel_controls {
+    unsigned char   msb[32];        // controllers 0 - 31
+    unsigned char   rpn[2];         // selected RPN, LSB then MSB
+    unsigned char   nrpn[2];
+    int             parameter;      // index of the selected one, or -1
+    int             pending;        // parameter awaiting its LSB, or -1
+} midimap_channel_controls;
+
+// Signals of a MIDI input in the controller layout. Controllers 0 - 31
+// are 14-bit, with 32 - 63 as their LSBs, and RPN and NRPN data entry
+// updates the parameter selected rather than a controller.
+typedef struct _midimap_controllers {
+    mapper_signal   sigs[16][128];  // declared when first sent
+    midimap_channel_controls channels[16];
+    int             num_parameters;
+    midimap_parameter *parameters;
+} midimap_controllers;
+
+// Values of the vector signals of a device. MIDI inputs keep them so
+// that an update can send whole vectors, MIDI outputs so that only the
+// elements that changed are sent as MIDI.  An element of -1 is unset:
+// nothing has been received for it.
+typedef struct _midimap_vectors {
+    int             control_change[16][128];
+    int             pitch_wheel[16];
+    int             channel_pressure[16];
+    int             program_change[16];
+    unsigned int    dirty_controls;     // channels with unsent changes
+    bool            dirty_pitch_wheel;
+    bool            dirty_pressure;
+} midimap_vectors;
+
+// Maps the clock of a MIDI input (RtMidiIn::getTime) to libmapper time.
+// Offset and drift between the two are tracked with an alpha-beta
+// filter over paired samples of both clocks.
+typedef struct _midimap_clock_map {
+    double          offset;         // libmapper minus input time at last
+    double          rate;           // drift of the offset in s/s
+    double          last;           // input time of the latest sample
+    int             valid;
+} midimap_clock_map;
+
+// Voices of one MIDI channel. Each sounding note holds a slot, and the
+// slot number is the libmapper instance id of the note's signals, so a
+// note's instance is found without asking libmapper. On MIDI outputs
+// the slots are the local ids of the incoming instances instead.
+typedef struct _midimap_voices {
+    int             polyphony;
+    signed char     slot_of[128];               // slot of each note, or -1
+    signed char     note_of[MAX_POLYPHONY];     // note of each slot, or -1
+    unsigned char   velocity[MAX_POLYPHONY];    // 0 if not sounding
+    unsigned char   matched[MAX_POLYPHONY];     // instances already matched
+    unsigned int    started[MAX_POLYPHONY];     // note-on order of each slot
+    unsigned char   free_slots[MAX_POLYPHONY];
+    int             num_free;
+    unsigned int    counter;
+    uint64_t        active[2];                  // sounding notes, by number
+} midimap_voices;
+
+// Input signals declared for each channel.
+enum {
+    SIG_PITCH,
+    SIG_VELOCITY,
+    SIG_PRESSURE,
+    SIG_PITCH_WHEEL,
+    SIG_CONTROL_CHANGE,
+    SIG_PROGRAM_CHANGE,
+    SIG_CHANNEL_PRESSURE,
+    NUM_CHANNEL_SIGNALS
+};
+
+// Passed as user data to each libmapper input handler, so that it
+// needs no lookups to find where its updates go.
+typedef struct _midimap_signal_context {
+    struct _midimap_device *dev;
+    int             channel;        // 0 - 15
+    int             kind;           // MidiMessageKind sent for updates
+    // the signals of one note, whose instances are kept matched
+    mapper_signal   pitch;
+    mapper_signal   velocity;
+    mapper_signal   pressure;
+} midimap_signal_context;
+
+// Signals of an MPE zone, shared by the notes of all member channels.
+enum {
+    MPE_PITCH,
+    MPE_VELOCITY,
+    MPE_PRESSURE,
+    MPE_BEND,
+    MPE_TIMBRE,
+    NUM_MPE_SIGNALS
+};
+
+// A note of an MPE zone. On MIDI inputs the note in slot s of member
+// channel c is instance c * polyphony + s; on MIDI outputs incoming
+// instances are indexed by their local id.
+typedef struct _midimap_mpe_note {
+    signed char     channel;        // member channel while sounding, or -1
+    signed char     note;           // last pitch, or -1
+    unsigned char   matched;        // instances already matched
+    unsigned char   velocity;       // of the note-on while sounding
+    int             pressure;       // latest expression, sent with note-on
+    int             bend;
+    int             timbre;
+} midimap_mpe_note;
+
+// An MPE zone. Member channels carry one note each, so their pitch
+// wheel, channel pressure and timbre (CC 74) are per-note expression,
+// folded into the zone's instanced signals. The master channel keeps
+// its ordinary signals.
+typedef struct _midimap_mpe_zone {
+    int             master;
+    unsigned int    members;        // mask of the member channels
+    int             polyphony;      // slots per member channel
+    mapper_signal   sigs[NUM_MPE_SIGNALS];
+    midimap_signal_context contexts[NUM_MPE_SIGNALS];
+    int             pressure[16];   // latest expression of each channel,
+    int             bend[16];       // MIDI inputs only
+    int             timbre[16];
+    int             channel_notes[16];  // notes sounding, MIDI outputs only
+    int             next_channel;
+    midimap_mpe_note notes[MAX_MPE_NOTES];
+} midimap_mpe_zone;
+
 typedef struct _midimap_device {
     char            *name;
     mapper_device   mapper_dev;
@@ -25,367 +300,1669 @@ typedef struct _midimap_device {
     int             is_linked;
     mapper_signal   sig_pitch[16];
     mapper_signal   sig_vel[16];
-    mapper_signal   sig_aftrtch[16];
     mapper_signal   sig_ptch_wh[16];
     mapper_signal   sig_poly_pr[16];
     mapper_signal   sig_chan_pr[16];
     mapper_signal   sig_ctrl_ch[16];
     mapper_signal   sig_prog_ch[16];
+    midimap_signal_context contexts[16][NUM_CHANNEL_SIGNALS];
+    mapper_signal   vec_ptch_wh;    // vector layout only
+    mapper_signal   vec_chan_pr;
+    mapper_signal   vec_prog_ch;
+    midimap_vectors *vectors;
+    midimap_controllers *controllers;
+    midimap_mpe_zone *mpe;
+    int             polyphony;      // voices per channel
+    int             steal_policy;
+    midimap_voices  voices[16];
+    unsigned int    channels;       // mask of the channels mapped
+    unsigned char   declared[16];   // kinds with signals, MIDI inputs only
+    unsigned int    num_signals;
+    unsigned long   num_instances;  // reserved for the signals
+    int             num_fds;
+    midimap_watch   watches[MAX_DEVICE_FDS];
+    midimap_event_queue *queue;
+    midimap_controls *controls;
+    int             event_fd;       // signalled when queue has events
+    midimap_clock_map clock;
+    midimap_watch   event_watch;
+    midimap_output_queue *out_queue; // async output mode only
+    double          output_rate;    // bytes per second, 0 if unpaced
+    midimap_scheduler *scheduler;
+    double          clock_offset;   // MIDI output clock minus libmapper clock
+    unsigned long   sent_events;    // MIDI output totals
+    unsigned long   sent_bytes;
+    unsigned long   dropped_events; // lost to a full sender queue
     struct _midimap_device *next;
 } *midimap_device;
 
 struct _midimap_device *inputs = 0;
 struct _midimap_device *outputs = 0;
 
-std::vector<unsigned char> outmess (3, 0);
-
 void cleanup_device(midimap_device dev);
 
-int get_channel_from_signame(const char *name)
+// Controllers whose order relative to other messages carries meaning:
+// bank select, data entry, (N)RPN selection and channel mode messages.
+inline bool is_ordered_control(int control)
 {
-    char channel_str[4] = {0, 0, 0, 0};
-    int channel = 0;
-    if (name[8] != '.')
-        return -1;
-    strncpy(channel_str, &name[9], 3);
-    channel_str[strchr(channel_str, '/') - channel_str] = 0;
-    channel = atoi(channel_str) - 1;
-    if (channel < 1 || channel > 16)
-        return -1;
-    return channel-1;
+    return control == 0 || control == 32 || control == 6 || control == 38
+        || (control >= 96 && control <= 101)
+        || (control >= 120 && control < 128);
 }
 
-void pitch_handler(mapper_signal sig,
-                   mapper_db_signal props,
-                   int instance_id,
-                   void *value,
-                   int count,
-                   mapper_timetag_t *timetag)
+// Hand the MIDI sent to an output since its last flush to the system.
+void flush_output(midimap_device dev)
 {
-    // noteoff messages passed straight through with no instances
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev)
-        return;
-    if (!dev->midiout)
+    RtMidiOut::FlushCount count = dev->midiout->flush();
+    dev->sent_events += count.events;
+    dev->sent_bytes += count.bytes;
+}
+
+#ifdef __linux__
+// Sender thread of one output port.
+void *output_thread(void *user_data)
+{
+    midimap_device dev = (midimap_device)user_data;
+    midimap_output_queue *queue = dev->out_queue;
+
+    while (queue->running.load()) {
+        // clear the flag before reading head, so that messages queued
+        // after this point signal again
+        queue->signalled.store(false);
+        unsigned int head = queue->head.load();
+        unsigned int tail = queue->tail.load(std::memory_order_relaxed);
+        if (head == tail) {
+            uint64_t value;
+            ssize_t res = read(queue->wake_fd, &value, sizeof(value));
+            (void) res;
+            continue;
+        }
+        for (; tail != head; tail++) {
+            midimap_out_message *msg = &queue->messages[tail & (OUTPUT_QUEUE_SIZE - 1)];
+            try {
+                if (msg->time < 0)
+                    dev->midiout->sendMessage(msg->bytes, msg->length);
+                else
+                    dev->midiout->sendMessageAt(msg->bytes, msg->length,
+                                                msg->time);
+            }
+            catch (RtError &error) {
+                error.printMessage();
+            }
+            queue->tail.store(tail + 1, std::memory_order_release);
+        }
+        flush_output(dev);
+    }
+    return 0;
+}
+
+void start_output_thread(midimap_device dev)
+{
+    midimap_output_queue *queue = new midimap_output_queue();
+    queue->wake_fd = eventfd(0, EFD_CLOEXEC);
+    queue->running = true;
+    dev->out_queue = queue;
+    if (queue->wake_fd < 0
+        || pthread_create(&queue->thread, 0, output_thread, dev)) {
+        printf("Could not start sender thread for %s, sending synchronously.\n",
+               dev->name);
+        if (queue->wake_fd >= 0)
+            close(queue->wake_fd);
+        delete queue;
+        dev->out_queue = 0;
+    }
+}
+
+void stop_output_thread(midimap_device dev)
+{
+    midimap_output_queue *queue = dev->out_queue;
+    queue->running = false;
+    uint64_t value = 1;
+    ssize_t res = write(queue->wake_fd, &value, sizeof(value));
+    (void) res;
+    pthread_join(queue->thread, 0);
+    close(queue->wake_fd);
+    dev->dropped_events += queue->dropped;
+    delete queue;
+    dev->out_queue = 0;
+}
+#endif
+
+double timetag_seconds(const mapper_timetag_t *timetag)
+{
+    return timetag->sec + timetag->frac * (1.0 / 4294967296.0);
+}
+
+// Measure the offset from libmapper time to the MIDI output clock, so
+// that timetags can be converted without asking the driver each time.
+void sync_output_clock(midimap_device dev)
+{
+    mapper_timetag_t now;
+    mdev_timetag_now(dev->mapper_dev, &now);
+    dev->clock_offset = dev->midiout->getTime() - timetag_seconds(&now);
+}
+
+// Take a paired sample of a MIDI input's clock and libmapper's.
+void update_clock_map(midimap_device dev)
+{
+    mapper_timetag_t now;
+    double input = dev->midiin->getTime();
+    mdev_timetag_now(dev->mapper_dev, &now);
+    if (input <= 0)
         return;
 
-    int channel = get_channel_from_signame(props->name);
+    midimap_clock_map *map = &dev->clock;
+    double measured = timetag_seconds(&now) - input;
+    double elapsed = input - map->last;
+    if (!map->valid) {
+        map->offset = measured;
+        map->rate = 0;
+        map->valid = 1;
+    }
+    else if (elapsed <= 0)
+        return;
+    else {
+        double predicted = map->offset + map->rate * elapsed;
+        double error = measured - predicted;
+        if (fabs(error) > CLOCK_STEP) {
+            map->offset = measured;
+            map->rate = 0;
+        }
+        else {
+            map->offset = predicted + CLOCK_ALPHA * error;
+            map->rate += CLOCK_BETA * error / elapsed;
+        }
+    }
+    map->last = input;
+}
 
-    if (value) {
-        // make sure pitch instance is matched to velocity and aftertouch instances
-        msig_match_instances(sig, dev->sig_vel[channel], instance_id);
-        msig_match_instances(sig, dev->sig_aftrtch[channel], instance_id);
+// Convert the time a MIDI input stamped on an event to a timetag,
+// falling back to the current time if the input has no clock.
+void event_timetag(midimap_device dev, double time, mapper_timetag_t *timetag)
+{
+    midimap_clock_map *map = &dev->clock;
+    if (time <= 0 || !map->valid) {
+        mdev_timetag_now(dev->mapper_dev, timetag);
+        return;
     }
+    double seconds = time + map->offset + map->rate * (time - map->last);
+    timetag->sec = (uint32_t)seconds;
+    timetag->frac = (uint32_t)((seconds - timetag->sec) * 4294967296.0);
 }
 
-void velocity_handler(mapper_signal sig,
-                      mapper_db_signal props,
-                      int instance_id,
-                      void *value,
-                      int count,
-                      mapper_timetag_t *timetag)
+// Hand a message to the output port, or to its sender thread.
+void write_midi(midimap_device dev, const unsigned char *bytes,
+                unsigned int length, double time)
 {
-    // noteon messages passed straight through with no instances
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev)
+    midimap_output_queue *queue = dev->out_queue;
+    if (!queue) {
+        if (time < 0)
+            dev->midiout->sendMessage(bytes, length);
+        else
+            dev->midiout->sendMessageAt(bytes, length, time);
         return;
-    if (!dev->midiout)
+    }
+
+    unsigned int head = queue->head.load(std::memory_order_relaxed);
+    if (head - queue->tail.load(std::memory_order_acquire) >= OUTPUT_QUEUE_SIZE) {
+        queue->dropped.fetch_add(1, std::memory_order_relaxed);
         return;
+    }
+    midimap_out_message *msg = &queue->messages[head & (OUTPUT_QUEUE_SIZE - 1)];
+    msg->time = time;
+    memcpy(msg->bytes, bytes, length);
+    msg->length = length;
+    queue->head.store(head + 1);
+#ifdef __linux__
+    if (!queue->signalled.exchange(true)) {
+        uint64_t value = 1;
+        ssize_t res = write(queue->wake_fd, &value, sizeof(value));
+        (void) res;
+    }
+#endif
+}
 
-    int channel = get_channel_from_signame(props->name);
+midimap_scheduler *new_scheduler(midimap_device dev, double rate)
+{
+    midimap_scheduler *sched = new midimap_scheduler();
+    mapper_timetag_t now;
+    mdev_timetag_now(dev->mapper_dev, &now);
+    sched->rate = rate;
+    sched->tokens = rate * SCHEDULER_BURST;
+    sched->last = timetag_seconds(&now);
+    return sched;
+}
 
-    if (value) {
-        // make sure velocity instance is matched to pitch and aftertouch instances
-        msig_match_instances(sig, dev->sig_pitch[channel], instance_id);
-        msig_match_instances(sig, dev->sig_aftrtch[channel], instance_id);
+// Move the controller values pending on a channel into the FIFO, in
+// the order they were first queued.
+void flush_scheduled_controls(midimap_scheduler *sched, int channel)
+{
+    int kept = 0;
+    for (int i = 0; i < sched->count; i++) {
+        int key = sched->order[(sched->first + i) % (16 * NUM_CONTROLS)];
+        if (key / NUM_CONTROLS != channel) {
+            sched->order[(sched->first + kept++) % (16 * NUM_CONTROLS)] = key;
+            continue;
+        }
+        midimap_out_message *msg = &sched->controls[key];
+        if (sched->head - sched->tail < SCHEDULER_QUEUE_SIZE)
+            sched->messages[sched->head++ & (SCHEDULER_QUEUE_SIZE - 1)] = *msg;
+        else
+            sched->dropped++;
+        msg->length = 0;
     }
+    sched->count = kept;
+}
 
-    int *v = (int *)value;
+// Queue a message for a paced output.  Continuous controllers, channel
+// pressure and pitch wheel keep only their latest value; order-sensitive
+// controllers join the other messages in the FIFO.  A note-on first
+// moves its channel's pending values into the FIFO, so that the note
+// starts with the pitch wheel, pressure and controllers sent before it.
+void schedule_midi(midimap_scheduler *sched, const unsigned char *bytes,
+                   unsigned int length, double time)
+{
+    midimap_out_message *msg;
+    int control = -1;
+    switch (bytes[0] & 0xF0) {
+        case 0xB0:
+            if (!is_ordered_control(bytes[1]))
+                control = bytes[1];
+            break;
+        case 0xD0:
+            control = CONTROL_PRESSURE;
+            break;
+        case 0xE0:
+            control = CONTROL_PITCH_WHEEL;
+            break;
+    }
+    if (control >= 0) {
+        int key = (bytes[0] & 0x0F) * NUM_CONTROLS + control;
+        msg = &sched->controls[key];
+        if (msg->length)
+            sched->superseded++;
+        else
+            sched->order[(sched->first + sched->count++) % (16 * NUM_CONTROLS)] = key;
+    }
+    else {
+        if ((bytes[0] & 0xF0) == 0x90 && sched->count)
+            flush_scheduled_controls(sched, bytes[0] & 0x0F);
+        if (sched->head - sched->tail >= SCHEDULER_QUEUE_SIZE) {
+            sched->dropped++;
+            return;
+        }
+        msg = &sched->messages[sched->head++ & (SCHEDULER_QUEUE_SIZE - 1)];
+    }
+    msg->time = time;
+    memcpy(msg->bytes, bytes, length);
+    msg->length = length;
 
-    // output MIDI NOTEON message
-    unsigned char note = (long int)msig_instance_value(dev->sig_pitch[channel],
-                                                       instance_id, 0);
-    outmess[0] = channel + NOTE_ON;
-    outmess[1] = note ?: 60;
-    outmess[2] = v[0];
-    dev->midiout->sendMessage(&outmess);
+    unsigned int depth = sched->head - sched->tail + sched->count;
+    if (depth > sched->max_depth)
+        sched->max_depth = depth;
 }
 
-void aftertouch_handler(mapper_signal sig,
-                        mapper_db_signal props,
-                        int instance_id,
-                        void *value,
-                        int count,
-                        mapper_timetag_t *timetag)
+// Send what a paced output's rate allows by now, ordered messages
+// first, or everything if all is set.
+void run_scheduler(midimap_device dev, bool all)
 {
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev || !value)
-        return;
+    midimap_scheduler *sched = dev->scheduler;
+    mapper_timetag_t now;
+    mdev_timetag_now(dev->mapper_dev, &now);
+    double time = timetag_seconds(&now);
+    sched->tokens += (time - sched->last) * sched->rate;
+    sched->last = time;
+    if (sched->tokens > sched->rate * SCHEDULER_BURST)
+        sched->tokens = sched->rate * SCHEDULER_BURST;
+
+    while (all || sched->tokens > 0) {
+        midimap_out_message *msg;
+        if (sched->head != sched->tail)
+            msg = &sched->messages[sched->tail++ & (SCHEDULER_QUEUE_SIZE - 1)];
+        else if (sched->count) {
+            msg = &sched->controls[sched->order[sched->first]];
+            sched->first = (sched->first + 1) % (16 * NUM_CONTROLS);
+            sched->count--;
+        }
+        else
+            break;
+        write_midi(dev, msg->bytes, msg->length, msg->time);
+        sched->tokens -= msg->length;
+        msg->length = 0;
+    }
+}
+
+// Milliseconds until a paced output may send what it holds, or -1 if
+// none holds anything.
+int scheduler_timeout()
+{
+    int timeout = -1;
+    for (midimap_device temp = inputs; temp; temp = temp->next) {
+        midimap_scheduler *sched = temp->scheduler;
+        if (!sched || (sched->head == sched->tail && !sched->count))
+            continue;
+        int wait = sched->tokens > 0 ? 0
+                   : (int)(-sched->tokens * 1000 / sched->rate) + 1;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
 
-    int channel = get_channel_from_signame(props->name);
+// Send a message now, or hand it to the output's sender thread or
+// scheduler.  In fixed latency mode the message is scheduled for its
+// timetag plus the latency, so that network jitter becomes a constant
+// delay.
+void send_midi(midimap_device dev, const unsigned char *bytes,
+               unsigned int length, mapper_timetag_t *timetag)
+{
+    double time = -1;
+    if (latency >= 0) {
+        mapper_timetag_t now;
+        if (!timetag || (!timetag->sec && !timetag->frac)) {
+            mdev_timetag_now(dev->mapper_dev, &now);
+            timetag = &now;
+        }
+        time = timetag_seconds(timetag) + dev->clock_offset + latency;
+    }
 
-    if (value) {
-        // make sure pitch instance is matched to pitch and velocity instances
-        msig_match_instances(sig, dev->sig_pitch[channel], instance_id);
-        msig_match_instances(sig, dev->sig_vel[channel], instance_id);
+    if (dev->scheduler)
+        schedule_midi(dev->scheduler, bytes, length, time);
+    else
+        write_midi(dev, bytes, length, time);
+}
+
+// Release paced MIDI, then flush the outputs written synchronously
+// during this cycle.
+void flush_all_outputs()
+{
+    for (midimap_device temp = inputs; temp; temp = temp->next) {
+        if (!temp->midiout)
+            continue;
+        if (temp->scheduler)
+            run_scheduler(temp, false);
+        if (!temp->out_queue)
+            flush_output(temp);
+    }
+}
+
+inline void set_active(midimap_voices *voices, int note)
+{
+    voices->active[note >> 6] |= 1ULL << (note & 63);
+}
+
+inline bool is_active(const midimap_voices *voices, int note)
+{
+    return voices->active[note >> 6] >> (note & 63) & 1;
+}
+
+inline void clear_active(midimap_voices *voices, int note)
+{
+    voices->active[note >> 6] &= ~(1ULL << (note & 63));
+}
+
+void init_voices(midimap_voices *voices, int polyphony)
+{
+    voices->polyphony = polyphony;
+    memset(voices->slot_of, -1, sizeof(voices->slot_of));
+    memset(voices->note_of, -1, sizeof(voices->note_of));
+    memset(voices->velocity, 0, sizeof(voices->velocity));
+    memset(voices->matched, 0, sizeof(voices->matched));
+    // hand out the lowest slots first
+    for (int i = 0; i < polyphony; i++)
+        voices->free_slots[i] = polyphony - 1 - i;
+    voices->num_free = polyphony;
+    voices->counter = 0;
+    voices->active[0] = voices->active[1] = 0;
+}
+
+// Find the slot for a note-on. A note already sounding keeps its slot.
+// Returns -1 if every slot is taken and the policy forbids stealing;
+// otherwise *stolen is the note whose slot was taken, or -1.
+int allocate_voice(midimap_voices *voices, int note, int velocity,
+                   int policy, int *stolen)
+{
+    int slot = voices->slot_of[note];
+    *stolen = -1;
+    if (slot < 0) {
+        if (voices->num_free)
+            slot = voices->free_slots[--voices->num_free];
+        else if (policy == STEAL_NONE)
+            return -1;
+        else {
+            // only runs with every slot sounding
+            slot = 0;
+            for (int i = 1; i < voices->polyphony; i++) {
+                if (policy == STEAL_QUIETEST
+                    && voices->velocity[i] != voices->velocity[slot]) {
+                    if (voices->velocity[i] < voices->velocity[slot])
+                        slot = i;
+                }
+                else if ((int)(voices->started[i] - voices->started[slot]) < 0)
+                    slot = i;
+            }
+            *stolen = voices->note_of[slot];
+            voices->slot_of[*stolen] = -1;
+            clear_active(voices, *stolen);
+        }
+        voices->slot_of[note] = slot;
+        voices->note_of[slot] = note;
+        set_active(voices, note);
     }
+    voices->velocity[slot] = velocity;
+    voices->started[slot] = voices->counter++;
+    return slot;
+}
 
-    // check if note exists
-    if (!msig_instance_value(dev->sig_vel[channel], instance_id, 0))
+// Free the slot of a note-off, returning it, or -1 if the note was
+// not sounding.
+int release_voice(midimap_voices *voices, int note)
+{
+    int slot = voices->slot_of[note];
+    if (slot >= 0) {
+        voices->slot_of[note] = -1;
+        voices->note_of[slot] = -1;
+        voices->velocity[slot] = 0;
+        voices->free_slots[voices->num_free++] = slot;
+        clear_active(voices, note);
+    }
+    return slot;
+}
+
+// Apply the settings given for a device on the command line.
+void configure_device(midimap_device dev, const char *name)
+{
+    dev->polyphony = default_config.polyphony;
+    dev->steal_policy = default_config.steal;
+    dev->output_rate = default_config.rate;
+    dev->channels = default_config.channels;
+    for (int i = 0; i < num_device_configs; i++) {
+        if (strcmp(device_configs[i].name, name))
+            continue;
+        if (device_configs[i].polyphony)
+            dev->polyphony = device_configs[i].polyphony;
+        if (device_configs[i].steal >= 0)
+            dev->steal_policy = device_configs[i].steal;
+        if (device_configs[i].rate >= 0)
+            dev->output_rate = device_configs[i].rate;
+        if (device_configs[i].channels)
+            dev->channels = device_configs[i].channels;
+    }
+    for (int i = 0; i < 16; i++)
+        init_voices(&dev->voices[i], dev->polyphony);
+
+    int mpe = default_config.mpe, members = default_config.mpe_members;
+    for (int i = 0; i < num_device_configs; i++) {
+        if (!strcmp(device_configs[i].name, name) && device_configs[i].mpe >= 0) {
+            mpe = device_configs[i].mpe;
+            members = device_configs[i].mpe_members;
+        }
+    }
+    if (mpe == MPE_OFF)
         return;
+    midimap_mpe_zone *zone = dev->mpe = new midimap_mpe_zone();
+    zone->master = mpe == MPE_LOWER ? 0 : 15;
+    for (int i = 1; i <= members; i++)
+        zone->members |= 1 << (mpe == MPE_LOWER ? i : 15 - i);
+    zone->polyphony = dev->polyphony;
+    for (int i = 0; i < 16; i++) {
+        zone->bend[i] = 8192;
+        zone->timbre[i] = 64;
+    }
+    for (int i = 0; i < MAX_MPE_NOTES; i++) {
+        zone->notes[i].channel = zone->notes[i].note = -1;
+        zone->notes[i].bend = 8192;
+        zone->notes[i].timbre = 64;
+    }
+}
 
-    // output MIDI AFTERTOUCH message
-    unsigned char note = (long int)msig_instance_value(dev->sig_pitch[channel],
-                                                       instance_id, 0);
-    int *v = (int *)value;
-    outmess[0] = channel + AFTERTOUCH;
-    outmess[1] = note ?: 60;
-    outmess[2] = v[0];
-    dev->midiout->sendMessage(&outmess);
-}
-
-void pitch_wheel_handler(mapper_signal sig,
-                         mapper_db_signal props,
-                         int instance_id,
-                         void *value,
-                         int count,
-                         mapper_timetag_t *timetag)
-{
-    // pitch wheel messages passed straight through with no instances
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev || !value)
+void pitch_handler(mapper_signal sig,
+                   mapper_db_signal props,
+                   int instance_id,
+                   void *value,
+                   int count,
+                   mapper_timetag_t *timetag)
+{
+    // noteoff messages passed straight through with no instances
+    midimap_signal_context *ctx = (midimap_signal_context *)props->user_data;
+    if (!ctx->dev->midiout)
         return;
 
-    int channel = get_channel_from_signame(props->name);
-    int *v = (int *)value;
+    midimap_voices *voices = &ctx->dev->voices[ctx->channel];
+    if ((unsigned int)instance_id >= MAX_POLYPHONY) {
+        if (value) {
+            msig_match_instances(sig, ctx->velocity, instance_id);
+            msig_match_instances(sig, ctx->pressure, instance_id);
+        }
+        return;
+    }
 
-    outmess[0] = channel + PITCH_WHEEL;
-    outmess[1] = v[0];
-    outmess[2] = v[0] >> 8;
-    dev->midiout->sendMessage(&outmess);
+    if (value) {
+        // make sure a new pitch instance is matched to velocity and
+        // pressure instances
+        if (!voices->matched[instance_id]) {
+            msig_match_instances(sig, ctx->velocity, instance_id);
+            msig_match_instances(sig, ctx->pressure, instance_id);
+            voices->matched[instance_id] = 1;
+        }
+        int note = *(int *)value & 0x7F, old = voices->note_of[instance_id];
+        if (voices->velocity[instance_id] && old >= 0 && note != old) {
+            // a sounding note that changes pitch is ended and restarted,
+            // so that its note-off goes to the key that is on
+            unsigned char off[3] = {(unsigned char)(0x80 | ctx->channel),
+                                    (unsigned char)old, 0};
+            unsigned char on[3] = {(unsigned char)(0x90 | ctx->channel),
+                                   (unsigned char)note,
+                                   voices->velocity[instance_id]};
+            send_midi(ctx->dev, off, 3, timetag);
+            send_midi(ctx->dev, on, 3, timetag);
+            clear_active(voices, old);
+            set_active(voices, note);
+        }
+        voices->note_of[instance_id] = note;
+    }
+    else {
+        // the id may next be given to another instance
+        voices->matched[instance_id] = 0;
+    }
 }
 
-void control_change_handler(mapper_signal sig,
-                            mapper_db_signal props,
-                            int instance_id,
-                            void *value,
-                            int count,
-                            mapper_timetag_t *timetag)
+// Handler for the input signals that send a MIDI message.  The status
+// byte, message length and value packing all follow from KIND at
+// compile time, and the message is built on the stack.
+template <int KIND>
+void message_handler(mapper_signal sig,
+                     mapper_db_signal props,
+                     int instance_id,
+                     void *value,
+                     int count,
+                     mapper_timetag_t *timetag)
 {
-    // control change messages passed straight through with no instances
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev || !value)
+    static const unsigned char status = 0x80 | KIND << 4;
+    static const unsigned int length = midiStatusTable[status].length;
+    static const bool per_note = KIND == MIDI_NOTE_ON || KIND == MIDI_POLY_PRESSURE;
+
+    midimap_signal_context *ctx = (midimap_signal_context *)props->user_data;
+    midimap_device dev = ctx->dev;
+    if (!dev->midiout)
         return;
 
-    int channel = get_channel_from_signame(props->name);
     int *v = (int *)value;
-
-    outmess[0] = channel + CONTROL_CHANGE;
-    outmess[1] = v[0];
-    outmess[2] = v[1];
-    dev->midiout->sendMessage(&outmess);
+    unsigned char bytes[length];
+    bytes[0] = status | ctx->channel;
+
+    if (per_note) {
+        // instances beyond the voice table cannot be tracked
+        if ((unsigned int)instance_id >= MAX_POLYPHONY)
+            return;
+        midimap_voices *voices = &dev->voices[ctx->channel];
+        if (value && !voices->matched[instance_id]) {
+            // make sure this instance is matched to the other note signals
+            msig_match_instances(sig, ctx->pitch, instance_id);
+            msig_match_instances(sig, KIND == MIDI_NOTE_ON ? ctx->pressure
+                                 : ctx->velocity, instance_id);
+            voices->matched[instance_id] = 1;
+        }
+        int note = voices->note_of[instance_id];
+        // key pressure only applies to a sounding note
+        if (KIND == MIDI_POLY_PRESSURE
+            && (!value || note < 0 || !is_active(voices, note)))
+            return;
+        bytes[1] = note < 0 ? 60 : note;
+        if (KIND == MIDI_NOTE_ON)
+            voices->velocity[instance_id] = value ? v[0] & 0x7F : 0;
+        // releasing a velocity instance ends the note
+        bytes[2] = value ? v[0] & 0x7F : 0;
+        if (KIND == MIDI_NOTE_ON) {
+            if (bytes[2])
+                set_active(voices, bytes[1]);
+            else
+                clear_active(voices, bytes[1]);
+        }
+    }
+    else {
+        // the remaining messages are passed straight through with no instances
+        if (!value)
+            return;
+        if (KIND == MIDI_PITCH_WHEEL) {
+            bytes[1] = v[0] & 0x7F;
+            bytes[2] = (v[0] >> 7) & 0x7F;
+        }
+        else {
+            bytes[1] = v[0] & 0x7F;
+            if (length == 3)
+                bytes[2] = v[1] & 0x7F;
+        }
+    }
+    send_midi(dev, bytes, length, timetag);
 }
 
-void program_change_handler(mapper_signal sig,
-                            mapper_db_signal props,
-                            int instance_id,
-                            void *value,
-                            int count,
-                            mapper_timetag_t *timetag)
+// Handler of the vector signals: sends MIDI only for the elements that
+// are set and differ from the last update, so unset (-1) elements are
+// never sent.  Bank select, data entry, parameter selection and the
+// channel mode messages depend on the order they arrive in, which a
+// vector does not carry, so those controllers are never sent from it.
+template <int KIND>
+void vector_handler(mapper_signal sig,
+                    mapper_db_signal props,
+                    int instance_id,
+                    void *value,
+                    int count,
+                    mapper_timetag_t *timetag)
 {
-    // program change messages passed straight through with no instances
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev || !value)
+    static const unsigned char status = 0x80 | KIND << 4;
+    static const unsigned int length = midiStatusTable[status].length;
+
+    midimap_signal_context *ctx = (midimap_signal_context *)props->user_data;
+    midimap_device dev = ctx->dev;
+    if (!dev->midiout || !value)
         return;
 
-    int channel = get_channel_from_signame(props->name);
-    int *v = (int *)value;
+    int *v = (int *)value, *state;
+    switch (KIND) {
+        case MIDI_CONTROL_CHANGE:
+            state = dev->vectors->control_change[ctx->channel];
+            break;
+        case MIDI_PITCH_WHEEL:
+            state = dev->vectors->pitch_wheel;
+            break;
+        case MIDI_CHANNEL_PRESSURE:
+            state = dev->vectors->channel_pressure;
+            break;
+        default:
+            state = dev->vectors->program_change;
+            break;
+    }
+    int size = KIND == MIDI_CONTROL_CHANGE ? 128 : 16;
+    for (int i = 0; i < size; i++) {
+        if (v[i] < 0 || v[i] == state[i])
+            continue;
+        if (KIND == MIDI_CONTROL_CHANGE && is_ordered_control(i))
+            continue;
+        state[i] = v[i];
+        // the 16-wide vectors hold one value per channel
+        int channel = KIND == MIDI_CONTROL_CHANGE ? ctx->channel : i;
+        if (!(dev->channels & 1 << channel))
+            continue;
+        unsigned char bytes[3] = {(unsigned char)(status | channel)};
+        if (KIND == MIDI_CONTROL_CHANGE) {
+            bytes[1] = i;
+            bytes[2] = v[i] & 0x7F;
+        }
+        else {
+            bytes[1] = v[i] & 0x7F;
+            bytes[2] = (v[i] >> 7) & 0x7F;
+        }
+        send_midi(dev, bytes, length, timetag);
+    }
+}
+
+// Start an MPE note on the member channel with the fewest notes,
+// sending its expression before the note-on.
+void start_mpe_note(midimap_device dev, midimap_mpe_note *note,
+                    int velocity, mapper_timetag_t *timetag)
+{
+    midimap_mpe_zone *zone = dev->mpe;
+    int channel = -1;
+    for (int i = 0; i < 16; i++) {
+        int c = (zone->next_channel + i) & 15;
+        if ((zone->members & 1 << c) && (channel < 0
+            || zone->channel_notes[c] < zone->channel_notes[channel]))
+            channel = c;
+    }
+    zone->next_channel = (channel + 1) & 15;
+    zone->channel_notes[channel]++;
+    note->channel = channel;
+    note->velocity = velocity & 0x7F;
+    if (note->note < 0)
+        note->note = 60;
+    set_active(&dev->voices[channel], note->note);
+
+    unsigned char bend[3] = {(unsigned char)(0xE0 | channel),
+                             (unsigned char)(note->bend & 0x7F),
+                             (unsigned char)((note->bend >> 7) & 0x7F)};
+    unsigned char pressure[2] = {(unsigned char)(0xD0 | channel),
+                                 (unsigned char)(note->pressure & 0x7F)};
+    unsigned char timbre[3] = {(unsigned char)(0xB0 | channel), 74,
+                               (unsigned char)(note->timbre & 0x7F)};
+    unsigned char on[3] = {(unsigned char)(0x90 | channel),
+                           (unsigned char)note->note,
+                           (unsigned char)(velocity & 0x7F)};
+    send_midi(dev, bend, 3, timetag);
+    send_midi(dev, pressure, 2, timetag);
+    send_midi(dev, timbre, 3, timetag);
+    send_midi(dev, on, 3, timetag);
+}
 
-    outmess[0] = channel + PROGRAM_CHANGE;
-    outmess[1] = v[0];
-    dev->midiout->sendMessage(&outmess);
+void end_mpe_note(midimap_device dev, midimap_mpe_note *note,
+                  mapper_timetag_t *timetag)
+{
+    unsigned char off[3] = {(unsigned char)(0x80 | note->channel),
+                            (unsigned char)note->note, 0};
+    send_midi(dev, off, 3, timetag);
+    clear_active(&dev->voices[note->channel], note->note);
+    dev->mpe->channel_notes[note->channel]--;
+    note->channel = -1;
+    note->pressure = 0;
+    note->bend = 8192;
+    note->timbre = 64;
 }
 
-void channel_pressure_handler(mapper_signal sig,
-                              mapper_db_signal props,
-                              int instance_id,
-                              void *value,
-                              int count,
-                              mapper_timetag_t *timetag)
+// Handler of the signals of an MPE zone: each incoming instance is a
+// note, given a member channel of its own while it sounds.
+template <int SIGNAL>
+void mpe_handler(mapper_signal sig,
+                 mapper_db_signal props,
+                 int instance_id,
+                 void *value,
+                 int count,
+                 mapper_timetag_t *timetag)
 {
-    // channel pressure messages passed straight through with no instances
-    midimap_device dev = (midimap_device)props->user_data;
-    if (!dev || !value)
+    midimap_signal_context *ctx = (midimap_signal_context *)props->user_data;
+    midimap_device dev = ctx->dev;
+    midimap_mpe_zone *zone = dev->mpe;
+    if (!dev->midiout || (unsigned int)instance_id >= MAX_MPE_NOTES)
         return;
 
-    int channel = get_channel_from_signame(props->name);
-    int *v = (int *)value;
+    midimap_mpe_note *note = &zone->notes[instance_id];
+    int v = value ? *(int *)value : 0;
+    if (value && !note->matched) {
+        // make sure this instance is matched to the other zone signals
+        for (int i = 0; i < NUM_MPE_SIGNALS; i++) {
+            if (i != SIGNAL)
+                msig_match_instances(sig, zone->sigs[i], instance_id);
+        }
+        note->matched = 1;
+    }
 
-    outmess[0] = channel + CHANNEL_PRESSURE;
-    outmess[1] = v[0];
-    dev->midiout->sendMessage(&outmess);
+    unsigned char bytes[3];
+    unsigned int length = 3;
+    switch (SIGNAL) {
+        case MPE_PITCH:
+            if (!value) {
+                note->matched = 0;
+                return;
+            }
+            if (note->channel >= 0 && note->note != (v & 0x7F)) {
+                // end and restart a sounding note on its channel, so
+                // that its note-off goes to the key that is on
+                unsigned char off[3] = {(unsigned char)(0x80 | note->channel),
+                                        (unsigned char)note->note, 0};
+                unsigned char on[3] = {(unsigned char)(0x90 | note->channel),
+                                       (unsigned char)(v & 0x7F), note->velocity};
+                send_midi(dev, off, 3, timetag);
+                send_midi(dev, on, 3, timetag);
+                clear_active(&dev->voices[note->channel], note->note);
+                set_active(&dev->voices[note->channel], v & 0x7F);
+            }
+            note->note = v & 0x7F;
+            return;
+        case MPE_VELOCITY:
+            // releasing a velocity instance ends the note
+            if (value && v > 0) {
+                if (note->channel < 0)
+                    start_mpe_note(dev, note, v, timetag);
+            }
+            else if (note->channel >= 0)
+                end_mpe_note(dev, note, timetag);
+            return;
+        case MPE_PRESSURE:
+            if (!value)
+                return;
+            note->pressure = v;
+            bytes[0] = 0xD0;
+            bytes[1] = v & 0x7F;
+            length = 2;
+            break;
+        case MPE_BEND:
+            if (!value)
+                return;
+            note->bend = v;
+            bytes[0] = 0xE0;
+            bytes[1] = v & 0x7F;
+            bytes[2] = (v >> 7) & 0x7F;
+            break;
+        default:
+            if (!value)
+                return;
+            note->timbre = v;
+            bytes[0] = 0xB0;
+            bytes[1] = 74;
+            bytes[2] = v & 0x7F;
+            break;
+    }
+    // expression of a note not yet sounding goes out with its note-on
+    if (note->channel < 0)
+        return;
+    bytes[0] |= note->channel;
+    send_midi(dev, bytes, length, timetag);
+}
+
+midimap_vectors *new_vectors()
+{
+    midimap_vectors *vectors = new midimap_vectors();
+    std::fill(&vectors->control_change[0][0], &vectors->control_change[16][0], -1);
+    std::fill(vectors->pitch_wheel, vectors->pitch_wheel + 16, -1);
+    std::fill(vectors->channel_pressure, vectors->channel_pressure + 16, -1);
+    std::fill(vectors->program_change, vectors->program_change + 16, -1);
+    return vectors;
+}
+
+midimap_signal_context *signal_context(midimap_device dev, int channel,
+                                       int signal, int kind)
+{
+    midimap_signal_context *ctx = &dev->contexts[channel][signal];
+    ctx->dev = dev;
+    ctx->channel = channel;
+    ctx->kind = kind;
+    return ctx;
+}
+
+// Declare the signals of a device's MPE zone, as inputs on MIDI outputs
+// or as outputs on MIDI inputs.
+void add_mpe_signals(midimap_device dev, bool input)
+{
+    static const char *names[NUM_MPE_SIGNALS] = {
+        "/mpe/note/pitch", "/mpe/note/velocity", "/mpe/note/pressure",
+        "/mpe/note/bend", "/mpe/note/timbre"
+    };
+    static mapper_signal_handler *handlers[NUM_MPE_SIGNALS] = {
+        mpe_handler<MPE_PITCH>, mpe_handler<MPE_VELOCITY>,
+        mpe_handler<MPE_PRESSURE>, mpe_handler<MPE_BEND>,
+        mpe_handler<MPE_TIMBRE>
+    };
+    midimap_mpe_zone *zone = dev->mpe;
+    int min = 0, max7bit = 127, max14bit = 16383;
+    int instances = __builtin_popcount(zone->members) * zone->polyphony;
+    for (int i = 0; i < NUM_MPE_SIGNALS; i++) {
+        int *max = i == MPE_BEND ? &max14bit : &max7bit;
+        const char *unit = i == MPE_PITCH ? "midinote" : 0;
+        if (input) {
+            midimap_signal_context *ctx = &zone->contexts[i];
+            ctx->dev = dev;
+            ctx->channel = zone->master;
+            ctx->kind = i;
+            zone->sigs[i] = mdev_add_input(dev->mapper_dev, names[i], 1, 'i',
+                                           unit, &min, max, handlers[i], ctx);
+        }
+        else
+            zone->sigs[i] = mdev_add_output(dev->mapper_dev, names[i], 1, 'i',
+                                            unit, &min, max);
+        msig_reserve_instances(zone->sigs[i], instances - 1);
+    }
+    dev->num_signals += NUM_MPE_SIGNALS;
+    dev->num_instances += NUM_MPE_SIGNALS * instances;
 }
 
 void add_input_signals(midimap_device dev)
 {
     char signame[64];
-    int i, min = 0, max7bit = 127, max14bit = 16383;
+    int i, j, min = 0, max7bit = 127, max14bit = 16383;
     for (i = 0; i < 16; i++) {
+        if (!(dev->channels & 1 << i))
+            continue;
         snprintf(signame, 64, "/channel.%i/note/pitch", i+1);
         dev->sig_pitch[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', "midinote",
-                                           &min, &max7bit, pitch_handler, dev);
-        msig_reserve_instances(dev->sig_pitch[i], INSTANCES-1);
+                                           &min, &max7bit, pitch_handler,
+                                           signal_context(dev, i, SIG_PITCH, MIDI_NOTE_ON));
+        msig_reserve_instances(dev->sig_pitch[i], dev->polyphony-1);
 
         snprintf(signame, 64, "/channel.%i/note/velocity", i+1);
         dev->sig_vel[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
-                                         &min, &max7bit, velocity_handler, dev);
-        msig_reserve_instances(dev->sig_vel[i], INSTANCES-1);
-
-        snprintf(signame, 64, "/channel.%i/note/aftertouch", i+1);
-        dev->sig_aftrtch[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
-                                             &min, &max7bit, aftertouch_handler, dev);
-        msig_reserve_instances(dev->sig_aftrtch[i], INSTANCES-1);
-/*
+                                         &min, &max7bit, message_handler<MIDI_NOTE_ON>,
+                                         signal_context(dev, i, SIG_VELOCITY, MIDI_NOTE_ON));
+        msig_reserve_instances(dev->sig_vel[i], dev->polyphony-1);
+
         snprintf(signame, 64, "/channel.%i/note/pressure", i+1);
         dev->sig_poly_pr[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
-                                             &min, &max7bit, poly_pressure_handler, dev);
-        msig_reserve_instances(dev->sig_poly_pr[i], INSTANCES-1);
- */
-        snprintf(signame, 64, "/channel.%i/pitch_wheel", i+1);
-        dev->sig_ptch_wh[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
-                                             &min, &max14bit, pitch_wheel_handler, dev);
-        msig_reserve_instances(dev->sig_ptch_wh[i], INSTANCES-1);
+                                             &min, &max7bit, message_handler<MIDI_POLY_PRESSURE>,
+                                             signal_context(dev, i, SIG_PRESSURE, MIDI_POLY_PRESSURE));
+        msig_reserve_instances(dev->sig_poly_pr[i], dev->polyphony-1);
+        if (vector_signals) {
+            // the other kinds are 16-wide vectors declared below
+            snprintf(signame, 64, "/channel.%i/control_change", i+1);
+            dev->sig_ctrl_ch[i] = mdev_add_input(dev->mapper_dev, signame, 128, 'i', 0,
+                                                 &min, &max7bit, vector_handler<MIDI_CONTROL_CHANGE>,
+                                                 signal_context(dev, i, SIG_CONTROL_CHANGE, MIDI_CONTROL_CHANGE));
+            dev->num_signals += 4;
+            dev->num_instances += 3 * dev->polyphony + 1;
+        }
+        else {
+            snprintf(signame, 64, "/channel.%i/pitch_wheel", i+1);
+            dev->sig_ptch_wh[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
+                                                 &min, &max14bit, message_handler<MIDI_PITCH_WHEEL>,
+                                                 signal_context(dev, i, SIG_PITCH_WHEEL, MIDI_PITCH_WHEEL));
+            msig_reserve_instances(dev->sig_ptch_wh[i], INSTANCES-1);
+
+            // TODO: declare meaningful control change signals
+            snprintf(signame, 64, "/channel.%i/control_change", i+1);
+            dev->sig_ctrl_ch[i] = mdev_add_input(dev->mapper_dev, signame, 2, 'i', "midi",
+                                                 &min, &max7bit, message_handler<MIDI_CONTROL_CHANGE>,
+                                                 signal_context(dev, i, SIG_CONTROL_CHANGE, MIDI_CONTROL_CHANGE));
+            msig_reserve_instances(dev->sig_ctrl_ch[i], INSTANCES-1);
+
+            snprintf(signame, 64, "/channel.%i/program_change", i+1);
+            dev->sig_prog_ch[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
+                                                 &min, &max7bit, message_handler<MIDI_PROGRAM_CHANGE>,
+                                                 signal_context(dev, i, SIG_PROGRAM_CHANGE, MIDI_PROGRAM_CHANGE));
+            msig_reserve_instances(dev->sig_prog_ch[i], INSTANCES-1);
+
+            snprintf(signame, 64, "/channel.%i/channel_pressure", i+1);
+            dev->sig_chan_pr[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
+                                                 &min, &max7bit, message_handler<MIDI_CHANNEL_PRESSURE>,
+                                                 signal_context(dev, i, SIG_CHANNEL_PRESSURE, MIDI_CHANNEL_PRESSURE));
+            msig_reserve_instances(dev->sig_chan_pr[i], INSTANCES-1);
+
+            dev->num_signals += NUM_CHANNEL_SIGNALS;
+            dev->num_instances += 3 * dev->polyphony
+                                  + (NUM_CHANNEL_SIGNALS - 3) * INSTANCES;
+        }
+
+        // let every handler on this channel reach the note signals
+        for (j = 0; j < NUM_CHANNEL_SIGNALS; j++) {
+            dev->contexts[i][j].pitch = dev->sig_pitch[i];
+            dev->contexts[i][j].velocity = dev->sig_vel[i];
+            dev->contexts[i][j].pressure = dev->sig_poly_pr[i];
+        }
+    }
 
-        // TODO: declare meaningful control change signals
-        snprintf(signame, 64, "/channel.%i/control_change", i+1);
-        dev->sig_ctrl_ch[i] = mdev_add_input(dev->mapper_dev, signame, 2, 'i', "midi",
-                                             &min, &max7bit, control_change_handler, dev);
-        msig_reserve_instances(dev->sig_ctrl_ch[i], INSTANCES-1);
+    if (vector_signals) {
+        dev->vectors = new_vectors();
+        dev->vec_ptch_wh = mdev_add_input(dev->mapper_dev, "/pitch_wheel", 16, 'i', 0,
+                                          &min, &max14bit, vector_handler<MIDI_PITCH_WHEEL>,
+                                          signal_context(dev, 0, SIG_PITCH_WHEEL, MIDI_PITCH_WHEEL));
+        dev->vec_prog_ch = mdev_add_input(dev->mapper_dev, "/program_change", 16, 'i', 0,
+                                          &min, &max7bit, vector_handler<MIDI_PROGRAM_CHANGE>,
+                                          signal_context(dev, 0, SIG_PROGRAM_CHANGE, MIDI_PROGRAM_CHANGE));
+        dev->vec_chan_pr = mdev_add_input(dev->mapper_dev, "/channel_pressure", 16, 'i', 0,
+                                          &min, &max7bit, vector_handler<MIDI_CHANNEL_PRESSURE>,
+                                          signal_context(dev, 0, SIG_CHANNEL_PRESSURE, MIDI_CHANNEL_PRESSURE));
+        dev->num_signals += 3;
+        dev->num_instances += 3;
+    }
 
-        snprintf(signame, 64, "/channel.%i/program_change", i+1);
-        dev->sig_prog_ch[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
-                                             &min, &max7bit, program_change_handler, dev);
-        msig_reserve_instances(dev->sig_prog_ch[i], INSTANCES-1);
+    if (dev->mpe)
+        add_mpe_signals(dev, true);
+}
 
-        snprintf(signame, 64, "/channel.%i/channel_pressure", i+1);
-        dev->sig_chan_pr[i] = mdev_add_input(dev->mapper_dev, signame, 1, 'i', 0,
-                                             &min, &max7bit, channel_pressure_handler, dev);
-        msig_reserve_instances(dev->sig_chan_pr[i], INSTANCES-1);
+// Declare the vector output signal carrying one kind of message on a
+// channel: a 128-wide vector per channel for control changes, and one
+// 16-wide vector with an element per channel for the other kinds.
+void add_output_vector(midimap_device dev, int channel, int kind)
+{
+    char signame[64];
+    int min = 0, max7bit = 127, max14bit = 16383;
+    mapper_signal *sig;
+    switch (kind) {
+        case MIDI_CONTROL_CHANGE:
+            snprintf(signame, 64, "/channel.%i/control_change", channel+1);
+            dev->sig_ctrl_ch[channel] = mdev_add_output(dev->mapper_dev, signame, 128,
+                                                        'i', 0, &min, &max7bit);
+            dev->num_signals++;
+            dev->num_instances++;
+            return;
+        case MIDI_PITCH_WHEEL:
+            sig = &dev->vec_ptch_wh;
+            break;
+        case MIDI_PROGRAM_CHANGE:
+            sig = &dev->vec_prog_ch;
+            break;
+        case MIDI_CHANNEL_PRESSURE:
+            sig = &dev->vec_chan_pr;
+            break;
+        default:
+            return;
     }
+    if (*sig)
+        return;
+    *sig = mdev_add_output(dev->mapper_dev,
+                           kind == MIDI_PITCH_WHEEL ? "/pitch_wheel"
+                           : kind == MIDI_PROGRAM_CHANGE ? "/program_change"
+                           : "/channel_pressure", 16, 'i', 0, &min,
+                           kind == MIDI_PITCH_WHEEL ? &max14bit : &max7bit);
+    dev->num_signals++;
+    dev->num_instances++;
 }
 
-// Declare output signals
-void add_output_signals(midimap_device dev)
+// Declare the output signals carrying one kind of message on a channel.
+// Note-on declares all note signals, which note-off and key pressure
+// then use.
+void add_output_signals(midimap_device dev, int channel, int kind)
 {
     char signame[64];
-    int i, min = 0, max7bit = 127, max14bit = 16383;
-    for (i = 0; i < 16; i++) {
-        snprintf(signame, 64, "/channel.%i/note/pitch", i+1);
-        dev->sig_pitch[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                            'i', "midinote", &min, &max7bit);
-        msig_reserve_instances(dev->sig_pitch[i], INSTANCES-1);
+    int i = channel, min = 0, max7bit = 127, max14bit = 16383;
+    // controller signals are declared as each controller is sent
+    if (controller_signals && kind == MIDI_CONTROL_CHANGE) {
+        dev->declared[channel] |= 1 << kind;
+        return;
+    }
+    if (vector_signals && kind != MIDI_NOTE_ON) {
+        add_output_vector(dev, channel, kind);
+        dev->declared[channel] |= 1 << kind;
+        return;
+    }
+    switch (kind) {
+        case MIDI_NOTE_ON:
+            snprintf(signame, 64, "/channel.%i/note/pitch", i+1);
+            dev->sig_pitch[i] = mdev_add_output(dev->mapper_dev, signame, 1,
+                                                'i', "midinote", &min, &max7bit);
+            msig_reserve_instances(dev->sig_pitch[i], dev->polyphony-1);
+
+            snprintf(signame, 64, "/channel.%i/note/velocity", i+1);
+            dev->sig_vel[i] = mdev_add_output(dev->mapper_dev, signame, 1,
+                                              'i', 0, &min, &max7bit);
+            msig_reserve_instances(dev->sig_vel[i], dev->polyphony-1);
+
+            snprintf(signame, 64, "/channel.%i/note/pressure", i+1);
+            dev->sig_poly_pr[i] = mdev_add_output(dev->mapper_dev, signame, 1,
+                                                  'i', 0, &min, &max7bit);
+            msig_reserve_instances(dev->sig_poly_pr[i], dev->polyphony-1);
+            dev->num_signals += 3;
+            dev->num_instances += 3 * dev->polyphony;
+            break;
+        case MIDI_PITCH_WHEEL:
+            snprintf(signame, 64, "/channel.%i/pitch_wheel", i+1);
+            dev->sig_ptch_wh[i] = mdev_add_output(dev->mapper_dev, signame, 1,
+                                                  'i', 0, &min, &max14bit);
+            msig_reserve_instances(dev->sig_ptch_wh[i], INSTANCES-1);
+            dev->num_signals++;
+            dev->num_instances += INSTANCES;
+            break;
+        case MIDI_CONTROL_CHANGE:
+            // -K declares a named signal per controller instead
+            snprintf(signame, 64, "/channel.%i/control_change", i+1);
+            dev->sig_ctrl_ch[i] = mdev_add_output(dev->mapper_dev, signame, 2,
+                                                  'i', "midi", &min, &max7bit);
+            msig_reserve_instances(dev->sig_ctrl_ch[i], INSTANCES-1);
+            dev->num_signals++;
+            dev->num_instances += INSTANCES;
+            break;
+        case MIDI_PROGRAM_CHANGE:
+            snprintf(signame, 64, "/channel.%i/program_change", i+1);
+            dev->sig_prog_ch[i] = mdev_add_output(dev->mapper_dev, signame, 1,
+                                                  'i', 0, &min, &max7bit);
+            msig_reserve_instances(dev->sig_prog_ch[i], INSTANCES-1);
+            dev->num_signals++;
+            dev->num_instances += INSTANCES;
+            break;
+        case MIDI_CHANNEL_PRESSURE:
+            snprintf(signame, 64, "/channel.%i/channel_pressure", i+1);
+            dev->sig_chan_pr[i] = mdev_add_output(dev->mapper_dev, signame, 1,
+                                                  'i', 0, &min, &max7bit);
+            msig_reserve_instances(dev->sig_chan_pr[i], INSTANCES-1);
+            dev->num_signals++;
+            dev->num_instances += INSTANCES;
+            break;
+        default:
+            return;
+    }
+    dev->declared[channel] |= 1 << kind;
+}
 
-        snprintf(signame, 64, "/channel.%i/note/velocity", i+1);
-        dev->sig_vel[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                          'i', 0, &min, &max7bit);
-        msig_reserve_instances(dev->sig_vel[i], INSTANCES-1);
+// Declare the output signals of a MIDI input: all of them, or in lazy
+// mode none until a message needs one.
+void add_all_output_signals(midimap_device dev)
+{
+    if (vector_signals)
+        dev->vectors = new_vectors();
+    if (controller_signals) {
+        dev->controllers = new midimap_controllers();
+        for (int i = 0; i < 16; i++) {
+            dev->controllers->channels[i].parameter = -1;
+            dev->controllers->channels[i].pending = -1;
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        // these kinds need no signals of their own
+        dev->declared[i] = 1 << MIDI_NOTE_OFF | 1 << MIDI_POLY_PRESSURE
+                           | 1 << MIDI_SYSTEM;
+        if (lazy_signals || !(dev->channels & 1 << i))
+            continue;
+        for (int kind = MIDI_NOTE_ON; kind < MIDI_SYSTEM; kind++)
+            add_output_signals(dev, i, kind);
+    }
+    if (dev->mpe)
+        add_mpe_signals(dev, false);
+}
 
-        snprintf(signame, 64, "/channel.%i/note/aftertouch", i+1);
-        dev->sig_aftrtch[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                              'i', 0, &min, &max7bit);
-        msig_reserve_instances(dev->sig_aftrtch[i], INSTANCES-1);
-        /*
-         snprintf(signame, 64, "/channel.%i/note/pressure", i+1);
-         dev->sig_poly_pr[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                               'i', 0, &min, &max7bit);
-         msig_reserve_instances(dev->sig_poly_pr[i], INSTANCES-1);
-         */
-        snprintf(signame, 64, "/channel.%i/pitch_wheel", i+1);
-        dev->sig_ptch_wh[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                              'i', 0, &min, &max14bit);
-        msig_reserve_instances(dev->sig_ptch_wh[i], INSTANCES-1);
-
-        // TODO: declare meaningful control change signals
-        snprintf(signame, 64, "/channel.%i/control_change", i+1);
-        dev->sig_ctrl_ch[i] = mdev_add_output(dev->mapper_dev, signame, 2,
-                                              'i', "midi", &min, &max7bit);
-        msig_reserve_instances(dev->sig_ctrl_ch[i], INSTANCES-1);
-
-        snprintf(signame, 64, "/channel.%i/program_change", i+1);
-        dev->sig_prog_ch[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                              'i', 0, &min, &max7bit);
-        msig_reserve_instances(dev->sig_prog_ch[i], INSTANCES-1);
+// End the instances of the note holding a slot.
+void release_note_instances(midimap_device dev, int channel, int slot)
+{
+    midimap_mpe_zone *zone = dev->mpe;
+    if (zone && zone->members & 1 << channel) {
+        int id = channel * zone->polyphony + slot;
+        for (int i = 0; i < NUM_MPE_SIGNALS; i++)
+            msig_release_instance(zone->sigs[i], id, tt);
+        return;
+    }
+    msig_release_instance(dev->sig_pitch[channel], slot, tt);
+    msig_release_instance(dev->sig_vel[channel], slot, tt);
+    msig_release_instance(dev->sig_poly_pr[channel], slot, tt);
+}
 
-        snprintf(signame, 64, "/channel.%i/channel_pressure", i+1);
-        dev->sig_chan_pr[i] = mdev_add_output(dev->mapper_dev, signame, 1,
-                                              'i', 0, &min, &max7bit);
-        msig_reserve_instances(dev->sig_chan_pr[i], INSTANCES-1);
+void midi_note_off(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    int channel = event->channel;
+    int slot = release_voice(&dev->voices[channel], event->data1);
+    if (slot >= 0)
+        release_note_instances(dev, channel, slot);
+}
+
+void midi_note_on(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    if (!event->data2) {
+        midi_note_off(dev, event);
+        return;
     }
+    int channel = event->channel, stolen;
+    int slot = allocate_voice(&dev->voices[channel], event->data1,
+                              event->data2, dev->steal_policy, &stolen);
+    if (slot < 0)
+        return;
+    // a stolen voice ends before its instances are reused
+    if (stolen >= 0)
+        release_note_instances(dev, channel, slot);
+    int data[2] = {event->data1, event->data2};
+    msig_update_instance(dev->sig_pitch[channel], slot, &data[0], 1, tt);
+    msig_update_instance(dev->sig_vel[channel], slot, &data[1], 1, tt);
 }
 
-void parse_midi(double deltatime, std::vector<unsigned char> *message, void *user_data)
+// Key pressure updates the pressure instance in the slot of its note,
+// and is dropped for a note that is not sounding.
+void midi_poly_pressure(midimap_device dev, const RtMidiIn::MidiEvent *event)
 {
-    if ((unsigned int)message->size() != 3)
+    midimap_voices *voices = &dev->voices[event->channel];
+    if (!is_active(voices, event->data1))
         return;
+    int value = event->data2;
+    msig_update_instance(dev->sig_poly_pr[event->channel],
+                         voices->slot_of[event->data1], &value, 1, tt);
+}
 
-    midimap_device dev = (midimap_device)user_data;
-    if (!mdev_ready(dev->mapper_dev))
+void send_control(midimap_device dev, int channel, int control, int value);
+void send_vectors(midimap_device dev);
+
+// Hold back a controller value until the bundle is sent.  Bank select,
+// data entry, parameter selection and the channel mode messages take
+// their meaning from the order they arrive in, so they go out at once.
+void defer_control(midimap_device dev, int channel, int control, int value)
+{
+    if (is_ordered_control(control)) {
+        send_control(dev, channel, control, value);
+        if (dev->vectors)
+            send_vectors(dev);
         return;
+    }
+    midimap_controls *controls = dev->controls;
+    int key = channel * NUM_CONTROLS + control;
+    if (controls->value[key] < 0)
+        controls->order[controls->count++] = key;
+    controls->value[key] = value;
+}
 
-    int msg_type = ((int)message->at(0) - 0x80) / 0x0F;
-    int channel = ((int)message->at(0) - 0x80) % 0x0F - 1;
-    int data[2] = {(int)message->at(1), (int)message->at(2)};
-
-    mdev_timetag_now(dev->mapper_dev, &tt);
-    mdev_start_queue(dev->mapper_dev, tt);
-    switch (msg_type) {
-        case 0: // note-off message
-            msig_release_instance(dev->sig_pitch[channel],
-                                  data[0], tt);
-            msig_release_instance(dev->sig_vel[channel],
-                                  data[0], tt);
-            msig_release_instance(dev->sig_aftrtch[channel],
-                                  data[0], tt);
-            break;
-        case 1: // note-on message
-            if (data[1]) {
-                msig_update_instance(dev->sig_pitch[channel],
-                                     data[0], &data[0], 1, tt);
-                msig_update_instance(dev->sig_vel[channel],
-                                     data[0], &data[1], 1, tt);
+// Names of the controllers defined by the MIDI specification.
+const char *controller_names[128] = {
+    "bank_select", "modulation", "breath", 0, "foot", "portamento_time",
+    "data_entry", "volume", "balance", 0, "pan", "expression", "effect_1",
+    "effect_2", 0, 0, "general_1", "general_2", "general_3", "general_4",
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    "sustain", "portamento", "sostenuto", "soft_pedal", "legato", "hold_2",
+    "sound_variation", "timbre", "release_time", "attack_time",
+    "brightness", "decay_time", "vibrato_rate", "vibrato_depth",
+    "vibrato_delay", "sound_10", "general_5", "general_6", "general_7",
+    "general_8", "portamento_control", 0, 0, 0, 0, 0, 0, "reverb",
+    "tremolo", "chorus", "detune", "phaser", "data_increment",
+    "data_decrement", "nrpn_lsb", "nrpn_msb", "rpn_lsb", "rpn_msb",
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    "all_sound_off", "reset_controllers", "local_control", "all_notes_off",
+    "omni_off", "omni_on", "mono_on", "poly_on"
+};
+
+const char *rpn_names[] = {
+    "pitch_bend_range", "fine_tuning", "coarse_tuning", "tuning_program",
+    "tuning_bank", "modulation_depth_range"
+};
+
+// Find the signal of a controller, declaring it on first use.
+mapper_signal controller_signal(midimap_device dev, int channel, int control)
+{
+    mapper_signal *sig = &dev->controllers->sigs[channel][control];
+    if (!*sig) {
+        char signame[64];
+        int min = 0, max = control < 32 ? 16383 : 127;
+        if (controller_names[control])
+            snprintf(signame, 64, "/channel.%i/control/%s", channel+1,
+                     controller_names[control]);
+        else
+            snprintf(signame, 64, "/channel.%i/control/%i", channel+1, control);
+        *sig = mdev_add_output(dev->mapper_dev, signame, 1, 'i', 0, &min, &max);
+        dev->num_signals++;
+        dev->num_instances++;
+    }
+    return *sig;
+}
+
+// Find the parameter selected by an RPN or NRPN, adding it if new.
+// Returns -1 if there is no memory for it, which leaves none selected.
+int find_parameter(midimap_controllers *controllers, int channel, int nrpn,
+                   int number)
+{
+    int key = channel << 15 | nrpn << 14 | number;
+    for (int i = 0; i < controllers->num_parameters; i++) {
+        if (controllers->parameters[i].key == key)
+            return i;
+    }
+    midimap_parameter *parameters = (midimap_parameter *)
+        realloc(controllers->parameters,
+                (controllers->num_parameters + 1) * sizeof(midimap_parameter));
+    if (!parameters)
+        return -1;
+    controllers->parameters = parameters;
+    midimap_parameter *param = &controllers->parameters[controllers->num_parameters];
+    param->key = key;
+    param->value = 0;
+    param->sig = 0;
+    return controllers->num_parameters++;
+}
+
+// Update the signal of a parameter, declaring it on first use.
+void send_parameter(midimap_device dev, midimap_parameter *param)
+{
+    if (!param->sig) {
+        char signame[64];
+        int min = 0, max = 16383;
+        int channel = param->key >> 15, nrpn = param->key >> 14 & 1;
+        int number = param->key & 0x3FFF;
+        if (!nrpn && number < (int)(sizeof(rpn_names) / sizeof(rpn_names[0])))
+            snprintf(signame, 64, "/channel.%i/rpn/%s", channel+1,
+                     rpn_names[number]);
+        else
+            snprintf(signame, 64, "/channel.%i/%s/%i", channel+1,
+                     nrpn ? "nrpn" : "rpn", number);
+        param->sig = mdev_add_output(dev->mapper_dev, signame, 1, 'i', 0,
+                                     &min, &max);
+        dev->num_signals++;
+        dev->num_instances++;
+    }
+    msig_update(param->sig, &param->value, 1, tt);
+}
+
+// Send a data entry MSB still waiting for its LSB.
+void send_pending_parameter(midimap_device dev, midimap_channel_controls *cc)
+{
+    if (cc->pending < 0)
+        return;
+    send_parameter(dev, &dev->controllers->parameters[cc->pending]);
+    cc->pending = -1;
+}
+
+// Take a control change apart in the controller layout: parameter
+// selection and data entry update parameters in order, while the value
+// of a controller, made 14-bit from its MSB and LSB, is coalesced like
+// any other.  A data entry MSB is held until its LSB arrives or the
+// bundle ends, so that the parameter never shows the MSB with a stale
+// or cleared LSB when both are sent.
+void assemble_control(midimap_device dev, int channel, int control, int value)
+{
+    midimap_controllers *controllers = dev->controllers;
+    midimap_channel_controls *cc = &controllers->channels[channel];
+    switch (control) {
+        case 98:
+        case 99:
+        case 100:
+        case 101: {
+            send_pending_parameter(dev, cc);
+            int nrpn = control < 100;
+            unsigned char *number = nrpn ? cc->nrpn : cc->rpn;
+            number[control & 1] = value;
+            // 127, 127 deselects
+            if (number[0] == 127 && number[1] == 127)
+                cc->parameter = -1;
+            else
+                cc->parameter = find_parameter(controllers, channel, nrpn,
+                                               number[1] << 7 | number[0]);
+            return;
+        }
+        case 6:
+        case 38:
+        case 96:
+        case 97:
+            if (cc->parameter < 0)
+                break;
+            {
+                midimap_parameter *param = &controllers->parameters[cc->parameter];
+                if (control == 6) {
+                    param->value = value << 7;
+                    cc->pending = cc->parameter;
+                    return;
+                }
+                if (control == 38)
+                    param->value = (param->value & ~0x7F) | value;
+                else
+                    send_pending_parameter(dev, cc);
+                if (control == 96 && param->value < 16383)
+                    param->value++;
+                else if (control == 97 && param->value > 0)
+                    param->value--;
+                send_parameter(dev, param);
+                cc->pending = -1;
             }
-            else {
-                msig_release_instance(dev->sig_pitch[channel],
-                                      data[0], tt);
-                msig_release_instance(dev->sig_vel[channel],
-                                      data[0], tt);
-                msig_release_instance(dev->sig_aftrtch[channel],
-                                      data[0], tt);
+            return;
+    }
+    if (control < 32) {
+        // a new MSB clears the LSB
+        cc->msb[control] = value;
+        defer_control(dev, channel, control, value << 7);
+    }
+    else if (control < 64)
+        defer_control(dev, channel, control - 32,
+                      cc->msb[control - 32] << 7 | value);
+    else
+        defer_control(dev, channel, control, value);
+}
+
+// Record a controller value in the vector layout.
+void set_vector_control(midimap_vectors *vectors, int channel, int control,
+                        int value)
+{
+    if (control == CONTROL_PITCH_WHEEL) {
+        vectors->pitch_wheel[channel] = value;
+        vectors->dirty_pitch_wheel = true;
+    }
+    else if (control == CONTROL_PRESSURE) {
+        vectors->channel_pressure[channel] = value;
+        vectors->dirty_pressure = true;
+    }
+    else {
+        vectors->control_change[channel][control] = value;
+        vectors->dirty_controls |= 1 << channel;
+    }
+}
+
+// Send each vector changed since the last bundle once, whole.
+void send_vectors(midimap_device dev)
+{
+    midimap_vectors *vectors = dev->vectors;
+    for (unsigned int dirty = vectors->dirty_controls; dirty; dirty &= dirty - 1) {
+        int channel = __builtin_ctz(dirty);
+        msig_update(dev->sig_ctrl_ch[channel],
+                    vectors->control_change[channel], 1, tt);
+    }
+    vectors->dirty_controls = 0;
+    if (vectors->dirty_pitch_wheel)
+        msig_update(dev->vec_ptch_wh, vectors->pitch_wheel, 1, tt);
+    if (vectors->dirty_pressure)
+        msig_update(dev->vec_chan_pr, vectors->channel_pressure, 1, tt);
+    vectors->dirty_pitch_wheel = vectors->dirty_pressure = false;
+}
+
+// Update the signal of a controller, or record it in the vector layout.
+void send_control(midimap_device dev, int channel, int control, int value)
+{
+    int data[2] = {control, value};
+    if (dev->controllers && control < 128) {
+        msig_update(controller_signal(dev, channel, control), &data[1], 1, tt);
+        return;
+    }
+    if (dev->vectors) {
+        set_vector_control(dev->vectors, channel, control, data[1]);
+        return;
+    }
+    if (control == CONTROL_PITCH_WHEEL)
+        msig_update(dev->sig_ptch_wh[channel], &data[1], 1, tt);
+    else if (control == CONTROL_PRESSURE)
+        msig_update(dev->sig_chan_pr[channel], &data[1], 1, tt);
+    else
+        msig_update(dev->sig_ctrl_ch[channel], (void *)data, 1, tt);
+}
+
+// Update the signals of the controllers changed since the last bundle,
+// each with its latest value.
+void send_controls(midimap_device dev)
+{
+    midimap_controls *controls = dev->controls;
+    if (dev->controllers) {
+        for (int i = 0; i < 16; i++)
+            send_pending_parameter(dev, &dev->controllers->channels[i]);
+    }
+    for (int i = 0; i < controls->count; i++) {
+        int key = controls->order[i];
+        send_control(dev, key / NUM_CONTROLS, key % NUM_CONTROLS,
+                     controls->value[key]);
+        controls->value[key] = -1;
+    }
+    controls->count = 0;
+    if (dev->vectors)
+        send_vectors(dev);
+}
+
+void midi_control_change(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    if (dev->controllers)
+        assemble_control(dev, event->channel, event->data1, event->data2);
+    else
+        defer_control(dev, event->channel, event->data1, event->data2);
+}
+
+void midi_program_change(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    int value = event->data1;
+    if (dev->vectors) {
+        dev->vectors->program_change[event->channel] = value;
+        msig_update(dev->vec_prog_ch, dev->vectors->program_change, 1, tt);
+        return;
+    }
+    msig_update(dev->sig_prog_ch[event->channel], &value, 1, tt);
+}
+
+void midi_channel_pressure(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    defer_control(dev, event->channel, CONTROL_PRESSURE, event->data1);
+}
+
+void midi_pitch_wheel(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    defer_control(dev, event->channel, CONTROL_PITCH_WHEEL, event->value14);
+}
+
+void midi_ignore(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+}
+
+typedef void (*midi_handler)(midimap_device dev,
+                             const RtMidiIn::MidiEvent *event);
+
+// Indexed by MidiStatusInfo::handler.
+const midi_handler midi_handlers[MIDI_HANDLER_COUNT] = {
+    midi_note_off,          // MIDI_NOTE_OFF
+    midi_note_on,           // MIDI_NOTE_ON
+    midi_poly_pressure,     // MIDI_POLY_PRESSURE
+    midi_control_change,    // MIDI_CONTROL_CHANGE
+    midi_program_change,    // MIDI_PROGRAM_CHANGE
+    midi_channel_pressure,  // MIDI_CHANNEL_PRESSURE
+    midi_pitch_wheel,       // MIDI_PITCH_WHEEL
+    midi_ignore             // MIDI_SYSTEM
+};
+
+// Update one expression of every note sounding on a member channel,
+// usually just one.
+void update_mpe_expression(midimap_device dev, int channel, int signal,
+                           int value)
+{
+    midimap_mpe_zone *zone = dev->mpe;
+    midimap_voices *voices = &dev->voices[channel];
+    for (int word = 0; word < 2; word++) {
+        for (uint64_t notes = voices->active[word]; notes; notes &= notes - 1) {
+            int note = word << 6 | __builtin_ctzll(notes);
+            msig_update_instance(zone->sigs[signal],
+                                 channel * zone->polyphony + voices->slot_of[note],
+                                 &value, 1, tt);
+        }
+    }
+}
+
+// Fold a message on an MPE member channel into the zone's signals.
+// Returns false for messages that keep their ordinary signals.
+bool parse_mpe_event(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    midimap_mpe_zone *zone = dev->mpe;
+    int channel = event->channel, note = event->data1, slot, stolen;
+    midimap_voices *voices = &dev->voices[channel];
+    switch (midiStatusTable[event->type].handler) {
+        case MIDI_NOTE_ON:
+            if (event->data2) {
+                slot = allocate_voice(voices, note, event->data2,
+                                      dev->steal_policy, &stolen);
+                if (slot < 0)
+                    return true;
+                if (stolen >= 0)
+                    release_note_instances(dev, channel, slot);
+                // a note starts with the expression of its channel
+                int id = channel * zone->polyphony + slot;
+                int data[NUM_MPE_SIGNALS] = {note, event->data2,
+                                             zone->pressure[channel],
+                                             zone->bend[channel],
+                                             zone->timbre[channel]};
+                for (int i = 0; i < NUM_MPE_SIGNALS; i++)
+                    msig_update_instance(zone->sigs[i], id, &data[i], 1, tt);
+                return true;
             }
-            break;
-        case 2: // aftertouch message
-            msig_update_instance(dev->sig_aftrtch[channel],
-                                 data[0], &data[1], 1, tt);
-            break;
-        case 3: // control change message
-            msig_update(dev->sig_ctrl_ch[channel], (void *)data, 1, tt);
-            break;
-        case 4: // program change message
-            msig_update(dev->sig_prog_ch[channel], (void *)data, 1, tt);
-            break;
-        case 5: // channel pressure message
-            msig_update(dev->sig_chan_pr[channel], (void *)data, 1, tt);
-            break;
-        case 6: // pitch wheel message
-        {
-            int value = data[0] + (data[1] << 8);
-            msig_update(dev->sig_ptch_wh[channel], &value, 1, tt);
-            break;
+            // velocity 0 is a note-off
+        case MIDI_NOTE_OFF:
+            slot = release_voice(voices, note);
+            if (slot >= 0)
+                release_note_instances(dev, channel, slot);
+            return true;
+        case MIDI_POLY_PRESSURE:
+            if (is_active(voices, note)) {
+                int value = event->data2;
+                msig_update_instance(zone->sigs[MPE_PRESSURE],
+                                     channel * zone->polyphony + voices->slot_of[note],
+                                     &value, 1, tt);
+            }
+            return true;
+        case MIDI_CHANNEL_PRESSURE:
+            zone->pressure[channel] = event->data1;
+            update_mpe_expression(dev, channel, MPE_PRESSURE, event->data1);
+            return true;
+        case MIDI_PITCH_WHEEL:
+            zone->bend[channel] = event->value14;
+            update_mpe_expression(dev, channel, MPE_BEND, event->value14);
+            return true;
+        case MIDI_CONTROL_CHANGE:
+            if (event->data1 != 74)
+                return false;
+            zone->timbre[channel] = event->data2;
+            update_mpe_expression(dev, channel, MPE_TIMBRE, event->data2);
+            return true;
+    }
+    return false;
+}
+
+void parse_midi_event(midimap_device dev, const RtMidiIn::MidiEvent *event)
+{
+    int handler = midiStatusTable[event->type].handler;
+    if (!(dev->channels & 1 << event->channel))
+        return;
+    if (dev->mpe && dev->mpe->members & 1 << event->channel
+        && parse_mpe_event(dev, event))
+        return;
+    if (!(dev->declared[event->channel] & 1 << handler))
+        add_output_signals(dev, event->channel, handler);
+    midi_handlers[handler](dev, event);
+}
+
+// Event callback, on the MIDI input thread.  The events are only
+// queued here: libmapper devices are not thread-safe, so they are
+// handed to the mapper thread, which is woken once per batch.
+void parse_midi(const RtMidiIn::MidiEvent *events, unsigned int count,
+                void *user_data)
+{
+    midimap_device dev = (midimap_device)user_data;
+    midimap_event_queue *queue = dev->queue;
+    unsigned int head = queue->head.load(std::memory_order_relaxed);
+    unsigned int tail = queue->tail.load(std::memory_order_acquire);
+    unsigned int i;
+    for (i = 0; i < count && head - tail < EVENT_QUEUE_SIZE; i++)
+        queue->events[head++ & (EVENT_QUEUE_SIZE - 1)] = events[i];
+    queue->head.store(head);
+    if (i < count)
+        queue->dropped.fetch_add(count - i, std::memory_order_relaxed);
+
+#ifdef __linux__
+    if (i > 0 && dev->event_fd >= 0 && !queue->signalled.exchange(true)) {
+        uint64_t value = 1;
+        ssize_t res = write(dev->event_fd, &value, sizeof(value));
+        (void) res;
+    }
+#endif
+}
+
+// On the mapper thread: send everything queued for a device as a
+// single libmapper bundle.
+void drain_midi_events(midimap_device dev)
+{
+    midimap_event_queue *queue = dev->queue;
+    if (!queue)
+        return;
+#ifdef __linux__
+    uint64_t value;
+    while (dev->event_fd >= 0
+           && read(dev->event_fd, &value, sizeof(value)) > 0) {}
+#endif
+    // clear the flag before reading head, so that events queued after
+    // this point signal again
+    queue->signalled.store(false);
+    unsigned int head = queue->head.load();
+    unsigned int tail = queue->tail.load(std::memory_order_relaxed);
+    if (head == tail)
+        return;
+
+    if (mdev_ready(dev->mapper_dev)) {
+        // events are stamped with the time they were played; those
+        // close together share a bundle, which carries the note events
+        // in order and the last value of each controller
+        double bundle_time = -1;
+        for (; tail != head; tail++) {
+            RtMidiIn::MidiEvent *event = &queue->events[tail & (EVENT_QUEUE_SIZE - 1)];
+            if (bundle_time < 0 || event->time - bundle_time > bundle_window) {
+                if (bundle_time >= 0) {
+                    send_controls(dev);
+                    mdev_send_queue(dev->mapper_dev, tt);
+                }
+                event_timetag(dev, event->time, &tt);
+                mdev_start_queue(dev->mapper_dev, tt);
+                bundle_time = event->time;
+            }
+            parse_midi_event(dev, event);
+        }
+        send_controls(dev);
+        mdev_send_queue(dev->mapper_dev, tt);
+    }
+    queue->tail.store(head, std::memory_order_release);
+}
+
+// Milliseconds on the monotonic clock, for timing a scan.
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec * 0.000001;
+}
+
+// Count the signals and reserved instances declared so far.
+void count_signals(unsigned int *signals, unsigned long *instances)
+{
+    *signals = 0;
+    *instances = 0;
+    for (int i = 0; i < 2; i++) {
+        for (midimap_device temp = i ? inputs : outputs; temp; temp = temp->next) {
+            *signals += temp->num_signals;
+            *instances += temp->num_instances;
         }
-        default:
-            break;
     }
-    mdev_send_queue(dev->mapper_dev, tt);
 }
 
 // Check if any MIDI ports are available on the system
@@ -393,6 +1970,10 @@ void scan_midi_devices()
 {
     printf("Searching for MIDI devices...\n");
     char devname[128];
+    double start = now_ms();
+    unsigned int signals_before, signals;
+    unsigned long instances_before, instances;
+    count_signals(&signals_before, &instances_before);
 
     RtMidiIn *midiin = 0;
     RtMidiOut *midiout = 0;
@@ -427,13 +2008,22 @@ void scan_midi_devices()
                 }
             }
             dev->mapper_dev = mdev_new(devname, 0, 0);
+            configure_device(dev, devname);
+            dev->queue = new midimap_event_queue();
+            dev->controls = new midimap_controls();
+            memset(dev->controls->value, -1, sizeof(dev->controls->value));
+#ifdef __linux__
+            dev->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+            dev->event_fd = -1;
+#endif
             dev->midiin = new RtMidiIn();
             dev->midiin->openPort(i);
-            dev->midiin->setCallback(&parse_midi, dev);
+            dev->midiin->setEventCallback(&parse_midi, dev);
             dev->midiin->ignoreTypes(true, true, true);
             dev->next = outputs;
             outputs = dev;
-            add_output_signals(dev);
+            add_all_output_signals(dev);
         }
     }
     catch (RtError &error) {
@@ -472,9 +2062,22 @@ void scan_midi_devices()
                 }
             }
             dev->mapper_dev = mdev_new(devname, 0, 0);
+            configure_device(dev, devname);
+            dev->event_fd = -1;
             dev->midiin = 0;
             dev->midiout = new RtMidiOut();
             dev->midiout->openPort(i);
+            // messages are flushed once per poll cycle
+            dev->midiout->setDeferredFlush(true);
+            // the output clock, and its ALSA queue, only exist for latency mode
+            if (latency >= 0)
+                sync_output_clock(dev);
+            if (dev->output_rate > 0)
+                dev->scheduler = new_scheduler(dev, dev->output_rate);
+#ifdef __linux__
+            if (async_output)
+                start_output_thread(dev);
+#endif
             dev->next = inputs;
             inputs = dev;
             add_input_signals(dev);
@@ -486,6 +2089,11 @@ void scan_midi_devices()
 
     delete midiout;
 
+    count_signals(&signals, &instances);
+    printf("Declared %u signals with %lu reserved instances in %.1f ms.\n",
+           signals - signals_before, instances - instances_before,
+           now_ms() - start);
+
     return;
 
     /*
@@ -511,20 +2119,153 @@ void scan_midi_devices()
     }*/
 }
 
-void cleanup_device(midimap_device dev)
+#ifdef __linux__
+void unwatch_device(midimap_device dev)
 {
-    if (dev->name) {
-        free(dev->name);
+    for (int i = 0; i < dev->num_fds; i++)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev->watches[i].fd, 0);
+    dev->num_fds = 0;
+}
+
+// Register a device's sockets with the reactor.  libmapper opens more
+// of them once the device is ready, so this is repeated until the
+// count settles.
+void watch_device(midimap_device dev)
+{
+    if (epoll_fd < 0)
+        return;
+    if (dev->event_fd >= 0 && !dev->event_watch.dev) {
+        struct epoll_event event;
+        dev->event_watch.dev = dev;
+        dev->event_watch.fd = dev->event_fd;
+        event.events = EPOLLIN;
+        event.data.ptr = &dev->event_watch;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev->event_fd, &event);
     }
-    if (dev->mapper_dev) {
-        mdev_free(dev->mapper_dev);
+    if (mdev_num_fds(dev->mapper_dev) == dev->num_fds)
+        return;
+
+    int fds[MAX_DEVICE_FDS];
+    int num = mdev_get_fds(dev->mapper_dev, fds, MAX_DEVICE_FDS);
+    unwatch_device(dev);
+    for (int i = 0; i < num; i++) {
+        struct epoll_event event;
+        dev->watches[i].dev = dev;
+        dev->watches[i].fd = fds[i];
+        event.events = EPOLLIN;
+        event.data.ptr = &dev->watches[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+    }
+    dev->num_fds = num > 0 ? num : 0;
+}
+#endif
+
+// End every note still sounding through a device: MIDI outputs get one
+// flush of note-offs, sent immediately, and the instances of MIDI
+// inputs are released in one bundle. Only the notes in the active sets
+// are visited.
+void release_active_notes(midimap_device dev)
+{
+    bool bundle = dev->midiin && mdev_ready(dev->mapper_dev);
+    // whatever is still paced goes first, so that no note-on follows
+    // the note-offs
+    if (dev->scheduler)
+        run_scheduler(dev, true);
+    if (bundle) {
+        mdev_timetag_now(dev->mapper_dev, &tt);
+        mdev_start_queue(dev->mapper_dev, tt);
     }
+    for (int channel = 0; channel < 16; channel++) {
+        midimap_voices *voices = &dev->voices[channel];
+        for (int word = 0; word < 2; word++) {
+            for (uint64_t notes = voices->active[word]; notes; notes &= notes - 1) {
+                int note = word << 6 | __builtin_ctzll(notes);
+                if (dev->midiout) {
+                    // sent now rather than at now plus the latency,
+                    // since the output queue is freed with the port
+                    unsigned char bytes[3] = {(unsigned char)(0x80 | channel),
+                                              (unsigned char)note, 0};
+                    write_midi(dev, bytes, 3, -1);
+                }
+                else {
+                    int slot = release_voice(voices, note);
+                    if (bundle)
+                        release_note_instances(dev, channel, slot);
+                }
+            }
+            voices->active[word] = 0;
+        }
+    }
+    if (bundle)
+        mdev_send_queue(dev->mapper_dev, tt);
+    if (dev->midiout)
+        flush_output(dev);
+}
+
+void cleanup_device(midimap_device dev)
+{
+#ifdef __linux__
+    unwatch_device(dev);
+#endif
+    // stop MIDI input first, so that nothing is queued past this point
     if (dev->midiin) {
         delete dev->midiin;
     }
+#ifdef __linux__
+    // note-offs are then sent from this thread
+    if (dev->out_queue) {
+        stop_output_thread(dev);
+    }
+#endif
+    // deliver what was played before the input stopped, then end the
+    // notes left sounding
+    drain_midi_events(dev);
+    release_active_notes(dev);
+    if (dev->event_fd >= 0) {
+        close(dev->event_fd);
+    }
+    if (dev->queue) {
+        if (dev->queue->dropped)
+            printf("Dropped %lu MIDI events from %s: the event queue was full\n",
+                   dev->queue->dropped.load(), dev->name);
+        delete dev->queue;
+    }
+    if (dev->controls) {
+        delete dev->controls;
+    }
+    if (dev->vectors) {
+        delete dev->vectors;
+    }
+    if (dev->controllers) {
+        free(dev->controllers->parameters);
+        delete dev->controllers;
+    }
+    if (dev->mpe) {
+        delete dev->mpe;
+    }
+    if (dev->mapper_dev) {
+        if (lazy_signals && dev->midiin)
+            printf("Declared %u signals with %lu reserved instances for %s\n",
+                   dev->num_signals, dev->num_instances, dev->name);
+        mdev_free(dev->mapper_dev);
+    }
     if (dev->midiout) {
+        flush_output(dev);
+        printf("Sent %lu MIDI messages (%lu bytes) to %s, %lu dropped\n",
+               dev->sent_events, dev->sent_bytes, dev->name,
+               dev->dropped_events);
+        if (dev->scheduler) {
+            printf("  at most %u messages waited, %lu controller values "
+                   "were superseded, %lu messages dropped\n",
+                   dev->scheduler->max_depth, dev->scheduler->superseded,
+                   dev->scheduler->dropped);
+            delete dev->scheduler;
+        }
         delete dev->midiout;
     }
+    if (dev->name) {
+        free(dev->name);
+    }
 }
 
 void cleanup_all_devices()
@@ -541,46 +2282,342 @@ void cleanup_all_devices()
         outputs = dev->next;
         cleanup_device(dev);
     }
+#ifdef __linux__
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (wakeup_fd >= 0)
+        close(wakeup_fd);
+    epoll_fd = wakeup_fd = -1;
+#endif
 }
 
-void loop()
+// Run libmapper's timers and pending work on every device.
+void poll_all_devices()
 {
-    //int counter = 0;
     midimap_device temp;
+    // poll libmapper outputs
+    temp = outputs;
+    while (temp) {
+        mdev_poll(temp->mapper_dev, 0);
+        if (temp->midiin)
+            update_clock_map(temp);
+        temp = temp->next;
+    }
+    // poll libmapper inputs
+    temp = inputs;
+    while (temp) {
+        mdev_poll(temp->mapper_dev, 0);
+        if (latency >= 0)
+            sync_output_clock(temp);
+        temp = temp->next;
+    }
+}
 
-    scan_midi_devices();
+#ifdef __linux__
+// Sleep until a libmapper socket is readable and service only the
+// device that owns it.  mdev_poll() still runs every HOUSEKEEPING_MS
+// for name allocation and other timed work.
+void run_reactor()
+{
+    struct epoll_event events[MAX_EVENTS];
+    double next_housekeeping = now_ms();
 
     while (!done) {
-        // poll libmapper outputs
-        temp = outputs;
-        while (temp) {
-            mdev_poll(temp->mapper_dev, 0);
-            temp = temp->next;
-        }
-        // poll libmapper inputs
-        temp = inputs;
-        while (temp) {
-            mdev_poll(temp->mapper_dev, 0);
-            temp = temp->next;
+        double now = now_ms();
+        if (now >= next_housekeeping) {
+            poll_all_devices();
+            next_housekeeping = now + HOUSEKEEPING_MS;
         }
+        midimap_device temp;
+        for (temp = outputs; temp; temp = temp->next)
+            watch_device(temp);
+        for (temp = inputs; temp; temp = temp->next)
+            watch_device(temp);
+
+        int timeout = (int)(next_housekeeping - now) + 1;
+        int wait = scheduler_timeout();
+        if (wait >= 0 && wait < timeout)
+            timeout = wait;
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            midimap_watch *watch = (midimap_watch *)events[i].data.ptr;
+            if (!watch) {
+                uint64_t value;
+                while (read(wakeup_fd, &value, sizeof(value)) > 0) {}
+                continue;
+            }
+            if (watch->fd == watch->dev->event_fd)
+                drain_midi_events(watch->dev);
+            else
+                mdev_service_fd(watch->dev->mapper_dev, watch->fd);
+        }
+        flush_all_outputs();
+    }
+}
+#endif
+
+void loop()
+{
+    scan_midi_devices();
+
+#ifdef __linux__
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = 0;
+    if (epoll_fd >= 0 && wakeup_fd >= 0
+        && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) == 0) {
+        run_reactor();
+        return;
+    }
+    printf("Could not create epoll set, falling back to polling.\n");
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    epoll_fd = -1;
+#endif
+
+    while (!done) {
+        for (midimap_device temp = outputs; temp; temp = temp->next)
+            drain_midi_events(temp);
+        poll_all_devices();
+        flush_all_outputs();
         usleep(10 * 1000);
         // TODO: debug & enable MIDI device rescan
-        //if (counter++ > 500) {
-        //    scan_midi_devices();
-        //    counter = 0;
-        //}
     }
 }
 
 void ctrlc(int sig)
 {
     done = 1;
+#ifdef __linux__
+    if (wakeup_fd >= 0) {
+        uint64_t value = 1;
+        ssize_t res = write(wakeup_fd, &value, sizeof(value));
+        (void) res;
+    }
+#endif
+}
+
+void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -a, --async-output    send MIDI from a thread per output port\n"
+           "  -l, --latency=MS      schedule MIDI output at its timetag plus a\n"
+           "                        fixed latency in milliseconds\n"
+           "  -c, --coalesce=MS     send the MIDI input played within MS\n"
+           "                        milliseconds as one update, keeping the\n"
+           "                        last value of each controller; \"cycle\"\n"
+           "                        coalesces each poll cycle (default %g)\n"
+           "  -p, --polyphony=[DEVICE=]N\n"
+           "                        voices per channel, 1 - %i (default %i)\n"
+           "  -s, --steal=[DEVICE=]POLICY\n"
+           "                        voice to end when a channel runs out:\n"
+           "                        oldest, quietest or none (default oldest)\n"
+           "  -r, --rate=[DEVICE=]BYTES\n"
+           "                        pace MIDI output to BYTES per second,\n"
+           "                        sending notes first; \"din\" for %i\n"
+           "  -C, --channels=[DEVICE=]LIST\n"
+           "                        map only the channels in LIST, such as\n"
+           "                        1-4,10 (default 1-16)\n"
+           "  -L, --lazy-signals    declare the signals of a MIDI input when\n"
+           "                        its first message of each kind arrives\n"
+           "  -V, --vector-signals  declare a 128-wide control change vector\n"
+           "                        per channel, and 16-wide pitch wheel,\n"
+           "                        program change and channel pressure\n"
+           "                        vectors with an element per channel\n"
+           "  -K, --controller-signals\n"
+           "                        declare a signal per controller as it is\n"
+           "                        first used, with 14-bit controllers\n"
+           "                        paired and RPNs and NRPNs assembled\n"
+           "  -M, --mpe=[DEVICE=]ZONE[:MEMBERS]\n"
+           "                        fold the notes and expression of an MPE\n"
+           "                        zone, lower or upper with 1 - 15 member\n"
+           "                        channels (default 15), into /mpe signals\n"
+           "  -h, --help            show this message\n"
+           "DEVICE limits a setting to the libmapper device of that name,\n"
+           "without its ordinal.\n", name, BUNDLE_WINDOW * 1000, MAX_POLYPHONY,
+           DEFAULT_POLYPHONY, DIN_RATE);
+}
+
+// Parse a list of channels and channel ranges numbered from 1, such
+// as 1-4,10, into a mask. Returns 0 if the list is not valid.
+unsigned int parse_channels(const char *list)
+{
+    unsigned int mask = 0;
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (end == list || first < 1 || last > 16 || first > last
+            || (*end && *end != ','))
+            return 0;
+        for (long i = first; i <= last; i++)
+            mask |= 1 << (i - 1);
+        list = *end ? end + 1 : end;
+    }
+    return mask;
 }
 
-int main ()
+// Find the settings named by a [DEVICE=]VALUE option, setting
+// *value to the VALUE part. Returns 0 if there are too many devices.
+midimap_device_config *device_config(char *arg, char **value)
 {
+    char *equals = strchr(arg, '=');
+    if (!equals) {
+        *value = arg;
+        return &default_config;
+    }
+    *equals = 0;
+    *value = equals + 1;
+    for (int i = 0; i < num_device_configs; i++) {
+        if (!strcmp(device_configs[i].name, arg))
+            return &device_configs[i];
+    }
+    if (num_device_configs == MAX_DEVICE_CONFIGS)
+        return 0;
+    midimap_device_config *config = &device_configs[num_device_configs++];
+    config->name = arg;
+    config->polyphony = 0;
+    config->steal = -1;
+    config->rate = -1;
+    config->channels = 0;
+    config->mpe = -1;
+    return config;
+}
+
+int main (int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"async-output", no_argument, 0, 'a'},
+        {"latency",      required_argument, 0, 'l'},
+        {"coalesce",     required_argument, 0, 'c'},
+        {"polyphony",    required_argument, 0, 'p'},
+        {"steal",        required_argument, 0, 's'},
+        {"rate",         required_argument, 0, 'r'},
+        {"channels",     required_argument, 0, 'C'},
+        {"lazy-signals", no_argument, 0, 'L'},
+        {"vector-signals", no_argument, 0, 'V'},
+        {"controller-signals", no_argument, 0, 'K'},
+        {"mpe",          required_argument, 0, 'M'},
+        {"help",         no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    midimap_device_config *config;
+    char *value;
+    int c, i;
+    while ((c = getopt_long(argc, argv, "al:c:p:s:r:C:LVKM:h", long_options, 0)) != -1) {
+        switch (c) {
+            case 'a':
+#ifdef __linux__
+                async_output = 1;
+#else
+                printf("Asynchronous output is not supported here, "
+                       "sending synchronously.\n");
+#endif
+                break;
+            case 'l':
+                latency = atof(optarg) * 0.001;
+                if (latency < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (!strcmp(optarg, "cycle"))
+                    bundle_window = HUGE_VAL;
+                else
+                    bundle_window = atof(optarg) * 0.001;
+                if (bundle_window < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p':
+                config = device_config(optarg, &value);
+                if (config)
+                    config->polyphony = atoi(value);
+                if (!config || config->polyphony < 1
+                    || config->polyphony > MAX_POLYPHONY) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                config = device_config(optarg, &value);
+                for (i = STEAL_QUIETEST; i >= 0; i--) {
+                    if (!strcmp(value, steal_names[i]))
+                        break;
+                }
+                if (config)
+                    config->steal = i;
+                if (!config || i < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                config = device_config(optarg, &value);
+                if (config)
+                    config->rate = strcmp(value, "din") ? atof(value) : DIN_RATE;
+                if (!config || config->rate < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'C':
+                config = device_config(optarg, &value);
+                if (config)
+                    config->channels = parse_channels(value);
+                if (!config || !config->channels) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'L':
+                lazy_signals = 1;
+                break;
+            case 'V':
+                vector_signals = 1;
+                break;
+            case 'K':
+                controller_signals = 1;
+                break;
+            case 'M': {
+                config = device_config(optarg, &value);
+                char *members = strchr(value, ':');
+                if (members)
+                    *members++ = 0;
+                for (i = MPE_UPPER; i >= 0; i--) {
+                    if (!strcmp(value, mpe_names[i]))
+                        break;
+                }
+                if (config) {
+                    config->mpe = i;
+                    config->mpe_members = members ? atoi(members) : 15;
+                }
+                if (!config || i < 0 || config->mpe_members < 1
+                    || config->mpe_members > 15) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
     signal(SIGINT, ctrlc);
 
+    // serve all MIDI inputs from one sequencer client and thread
+    RtMidiIn::setHubMode(true);
+
     loop();
 
     cleanup_all_devices();